@@ -0,0 +1,546 @@
+/*
+ * mbench.c - multithreaded benchmarks for the allocator in mm.c, built with
+ * -DDRIVER, and optionally for the C library's malloc.
+ *
+ * Each workload is run at 1, 2, 4, ... threads up to the maximum, which is
+ * always included. Every thread does the same number of operations at any
+ * thread count, so ideal scaling keeps the time constant:
+ * - larson: each thread keeps an array of blocks of random sizes and
+ *   replaces a random one at each step, as in a server handling requests.
+ *   Between rounds each thread takes over its neighbour's array, so some
+ *   blocks are freed by a thread other than the one that allocated them.
+ * - prodcons: threads are paired; one allocates blocks and passes them over
+ *   a queue to the other, which frees them. Every free is a remote free.
+ * - own: each thread allocates a batch of small blocks and frees them all,
+ *   in random order. No block leaves its thread.
+ * - mixed: like larson without the hand-off, with sizes drawn from a mix of
+ *   mostly tiny, some medium and a few large blocks.
+ *
+ * For each run the suite reports throughput in millions of malloc and free
+ * calls per second, scaling efficiency (throughput over the one-thread
+ * throughput times the number of threads), and memory in use at the end of
+ * the run, before the blocks still held are freed: the process's resident
+ * set, and for mm.c the bytes it holds in the heap and in mappings.
+ *
+ * usage: mbench [-g] [-H] [-t max_threads] [-o ops] [workload...]
+ *   -g  also run each workload against the C library's malloc
+ *   -H  back mm.c's heap with transparent huge pages
+ *   -t  largest thread count, by default the number of online CPUs
+ *   -o  malloc and free calls per thread and run
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define LARSON_SLOTS 1000       // Blocks held by each larson thread
+#define LARSON_ROUNDS 10        // Hand-offs per larson run
+#define QUEUE_SIZE 1024         // Blocks in flight between a prodcons pair
+#define OWN_BATCH 256           // Blocks per batch in own
+#define MIXED_SLOTS 256         // Blocks held by each mixed thread
+
+/* An allocator under test */
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    bool (*reset)(void);         // Starts from an empty heap
+    size_t (*footprint)(void);   // Bytes taken from the system, or NULL
+} allocator_t;
+
+/* A bounded queue from a producer to a consumer */
+typedef struct queue {
+    void *slots[QUEUE_SIZE];
+    size_t head;                 // Written by the producer
+    char pad[64 - sizeof(size_t)];
+    size_t tail;                 // Written by the consumer
+} queue_t;
+
+/* State of one benchmark thread */
+typedef struct worker {
+    pthread_t thread;
+    const allocator_t *alloc;
+    size_t index;
+    size_t nthreads;
+    size_t ops;                  // malloc and free calls to make
+    uint64_t rng;
+    void **blocks;               // Blocks held at the end of the run
+    size_t nblocks;
+    queue_t *queue;              // prodcons: queue of the thread's pair
+    double start;                // Bounds of the timed part
+    double end;
+} worker_t;
+
+typedef struct workload {
+    const char *name;
+    void *(*run)(void *arg);
+    size_t slots;                // Blocks a worker may hold at the end
+} workload_t;
+
+static pthread_barrier_t barrier;        // Start of the timed part
+static pthread_barrier_t round_barrier;  // Between larson rounds
+static worker_t *workers;
+static size_t ops_per_thread = 1000000;
+
+static bool mm_reset(void);
+static size_t mm_footprint(void);
+static bool libc_reset(void);
+static void *larson(void *arg);
+static void *prodcons(void *arg);
+static void *own(void *arg);
+static void *mixed(void *arg);
+static size_t mixed_size(uint64_t *rng);
+static void begin(worker_t *wk);
+static double run(const workload_t *w, const allocator_t *alloc, size_t nthreads,
+                  size_t *rss, size_t *footprint);
+static uint64_t next_rand(uint64_t *rng);
+static size_t rss_bytes(void);
+static double now(void);
+
+static const allocator_t allocators[] = {
+    { "mm", mm_malloc, mm_free, mm_reset, mm_footprint },
+    { "libc", malloc, free, libc_reset, NULL },
+};
+
+static const workload_t workloads[] = {
+    { "larson", larson, LARSON_SLOTS },
+    { "prodcons", prodcons, 0 },
+    { "own", own, 0 },
+    { "mixed", mixed, MIXED_SLOTS },
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+int main(int argc, char **argv)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = (ncpus > 0) ? (size_t) ncpus : 1;
+    bool with_libc = false;
+    bool huge = false;
+    bool selected[NUM_WORKLOADS];
+    int c;
+
+    while ((c = getopt(argc, argv, "gHt:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'g': with_libc = true; break;
+            case 'H': huge = true; break;
+            case 't': max_threads = (atol(optarg) > 0) ? (size_t) atol(optarg) : 1; break;
+            case 'o': ops_per_thread = (atol(optarg) > 0) ? (size_t) atol(optarg) : 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-g] [-H] [-t max_threads] [-o ops] [workload...]\n",
+                        argv[0]);
+                return 2;
+        }
+    }
+
+    for (size_t w = 0; w < NUM_WORKLOADS; w++)
+        selected[w] = (optind == argc);
+    for (int i = optind; i < argc; i++)
+    {
+        size_t w;
+        for (w = 0; w < NUM_WORKLOADS && strcmp(argv[i], workloads[w].name) != 0; w++)
+            ;
+        if (w == NUM_WORKLOADS)
+        {
+            fprintf(stderr, "%s: unknown workload %s\n", argv[0], argv[i]);
+            return 2;
+        }
+        selected[w] = true;
+    }
+
+    if ((workers = calloc(max_threads, sizeof(worker_t))) == NULL)
+        return 1;
+    mem_init(false, huge);
+
+    printf("%-9s %-5s %7s %9s %10s %10s %10s\n", "workload", "alloc", "threads",
+           "Mops/s", "efficiency", "rss MB", "heap MB");
+    for (size_t w = 0; w < NUM_WORKLOADS; w++)
+    {
+        if (!selected[w])
+            continue;
+        for (size_t a = 0; a < (with_libc ? 2 : 1); a++)
+        {
+            double base = 0;
+
+            for (size_t n = 1; ; n = (2 * n < max_threads) ? 2 * n : max_threads)
+            {
+                size_t rss, footprint;
+                double tput = run(&workloads[w], &allocators[a], n, &rss, &footprint);
+
+                if (tput == 0)
+                {
+                    printf("%-9s %-5s %7zu    FAILED\n", workloads[w].name,
+                           allocators[a].name, n);
+                    break;
+                }
+                if (n == 1)
+                    base = tput;
+                printf("%-9s %-5s %7zu %9.2f %9.1f%% %10.1f", workloads[w].name,
+                       allocators[a].name, n, tput / 1e6,
+                       (base > 0) ? 100.0 * tput / (base * n) : 0, rss / 1048576.0);
+                if (allocators[a].footprint != NULL)
+                    printf(" %10.1f\n", footprint / 1048576.0);
+                else
+                    printf(" %10s\n", "n/a");
+                fflush(stdout);
+                if (n == max_threads)
+                    break;
+            }
+        }
+    }
+
+    mem_deinit();
+    free(workers);
+    return 0;
+}
+
+/*
+ * mm_reset: gives mm.c an empty heap. Only called with no other threads.
+ */
+static bool mm_reset(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+/*
+ * mm_footprint: returns the bytes mm.c holds in the heap and in mappings.
+ */
+static size_t mm_footprint(void)
+{
+    return mem_heapsize() + mem_mapsize();
+}
+
+/*
+ * libc_reset: nothing to do; the C library's heap cannot be reset.
+ */
+static bool libc_reset(void)
+{
+    return true;
+}
+
+/*
+ * run: runs a workload on nthreads threads and returns its throughput in
+ *      calls per second, or 0 if it failed. Memory use is sampled once all
+ *      threads have finished, before the blocks they still hold are freed.
+ */
+static double run(const workload_t *w, const allocator_t *alloc, size_t nthreads,
+                  size_t *rss, size_t *footprint)
+{
+    queue_t *queues = NULL;
+    size_t started = 0;
+    size_t ops = 0;
+    double start, end, secs;
+    bool ok = alloc->reset();
+
+    if (ok && w->run == prodcons)
+        ok = ((queues = calloc(nthreads, sizeof(queue_t))) != NULL);
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+    pthread_barrier_init(&round_barrier, NULL, nthreads);
+    for (size_t i = 0; ok && i < nthreads; i++)
+    {
+        worker_t *wk = &workers[i];
+
+        memset(wk, 0, sizeof(*wk));
+        wk->alloc = alloc;
+        wk->index = i;
+        wk->nthreads = nthreads;
+        wk->ops = ops_per_thread;
+        wk->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        wk->queue = (queues != NULL) ? &queues[i & ~(size_t) 1] : NULL;
+        if (w->slots != 0 && (wk->blocks = calloc(w->slots, sizeof(void *))) == NULL)
+            ok = false;
+        else if (pthread_create(&wk->thread, NULL, w->run, wk) != 0)
+            ok = false;
+        else
+            started++;
+    }
+
+    /* Threads that started would wait at the barrier forever, so give up */
+    if (!ok)
+    {
+        fprintf(stderr, "%s: %s: could not set up %zu threads\n", w->name, alloc->name, nthreads);
+        exit(1);
+    }
+
+    for (size_t i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    /* Time from the first thread starting to the last finishing */
+    start = workers[0].start;
+    end = workers[0].end;
+    for (size_t i = 1; i < started; i++)
+    {
+        start = (workers[i].start < start) ? workers[i].start : start;
+        end = (workers[i].end > end) ? workers[i].end : end;
+    }
+    secs = end - start;
+
+    *rss = rss_bytes();
+    *footprint = (alloc->footprint != NULL) ? alloc->footprint() : 0;
+
+    for (size_t i = 0; i < started; i++)
+    {
+        for (size_t b = 0; b < workers[i].nblocks; b++)
+        {
+            if (workers[i].blocks[b] != NULL)
+                alloc->free(workers[i].blocks[b]);
+        }
+        free(workers[i].blocks);
+        ops += workers[i].ops;
+    }
+    free(queues);
+    pthread_barrier_destroy(&barrier);
+    pthread_barrier_destroy(&round_barrier);
+
+    return (secs > 0) ? ops / secs : 0;
+}
+
+/*
+ * larson: replaces random blocks of 16 to 512 bytes, moving to the next
+ *         thread's array after each round.
+ */
+static void *larson(void *arg)
+{
+    worker_t *wk = arg;
+    size_t rounds = (wk->ops / 2 > LARSON_ROUNDS) ? LARSON_ROUNDS : 1;
+    size_t steps = wk->ops / 2 / rounds;
+    void **blocks = wk->blocks;
+    size_t done = 0;
+
+    for (size_t i = 0; i < LARSON_SLOTS; i++)
+        blocks[i] = wk->alloc->malloc(16 + next_rand(&wk->rng) % 497);
+
+    begin(wk);
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (size_t s = 0; s < steps; s++)
+        {
+            size_t i = next_rand(&wk->rng) % LARSON_SLOTS;
+
+            wk->alloc->free(blocks[i]);
+            blocks[i] = wk->alloc->malloc(16 + next_rand(&wk->rng) % 497);
+            if (blocks[i] != NULL)
+                *(char *) blocks[i] = 0;
+        }
+        done += 2 * steps;
+
+        /* Hand the array on; the last thread to arrive swaps them */
+        if (wk->nthreads > 1 &&
+            pthread_barrier_wait(&round_barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+        {
+            void **first = workers[0].blocks;
+            for (size_t t = 0; t + 1 < wk->nthreads; t++)
+                workers[t].blocks = workers[t + 1].blocks;
+            workers[wk->nthreads - 1].blocks = first;
+        }
+        if (wk->nthreads > 1)
+            pthread_barrier_wait(&round_barrier);
+        blocks = wk->blocks;
+    }
+
+    wk->nblocks = LARSON_SLOTS;
+    wk->ops = done;
+    wk->end = now();
+    return NULL;
+}
+
+/*
+ * prodcons: even threads allocate blocks of 16 to 256 bytes and pass them
+ *           to the next thread, which frees them. A thread without a pair
+ *           frees its own blocks.
+ */
+static void *prodcons(void *arg)
+{
+    worker_t *wk = arg;
+    queue_t *q = wk->queue;
+    bool paired = (wk->index | 1) < wk->nthreads;
+    size_t n = wk->ops / 2;
+
+    begin(wk);
+
+    if (!paired)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            void *p = wk->alloc->malloc(16 + next_rand(&wk->rng) % 241);
+            wk->alloc->free(p);
+        }
+        wk->ops = 2 * n;
+    }
+    else if (wk->index % 2 == 0)
+    {
+        /* Producer */
+        for (size_t i = 0; i < n; i++)
+        {
+            void *p = wk->alloc->malloc(16 + next_rand(&wk->rng) % 241);
+            size_t head = q->head;
+
+            if (p != NULL)
+                *(char *) p = 0;
+            while (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) == QUEUE_SIZE)
+                sched_yield();
+            q->slots[head % QUEUE_SIZE] = p;
+            __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+        }
+        wk->ops = n;
+    }
+    else
+    {
+        /* Consumer */
+        for (size_t i = 0; i < n; i++)
+        {
+            size_t tail = q->tail;
+
+            while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == tail)
+                sched_yield();
+            wk->alloc->free(q->slots[tail % QUEUE_SIZE]);
+            __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        wk->ops = n;
+    }
+
+    wk->end = now();
+    return NULL;
+}
+
+/*
+ * own: allocates batches of blocks of 16 to 128 bytes and frees each batch
+ *      in random order.
+ */
+static void *own(void *arg)
+{
+    worker_t *wk = arg;
+    void *batch[OWN_BATCH];
+    size_t rounds = wk->ops / (2 * OWN_BATCH);
+
+    begin(wk);
+    for (size_t r = 0; r < rounds; r++)
+    {
+        for (size_t i = 0; i < OWN_BATCH; i++)
+        {
+            batch[i] = wk->alloc->malloc(16 + next_rand(&wk->rng) % 113);
+            if (batch[i] != NULL)
+                *(char *) batch[i] = 0;
+        }
+        for (size_t i = OWN_BATCH; i > 0; i--)
+        {
+            size_t j = next_rand(&wk->rng) % i;
+            wk->alloc->free(batch[j]);
+            batch[j] = batch[i - 1];
+        }
+    }
+
+    wk->ops = rounds * 2 * OWN_BATCH;
+    wk->end = now();
+    return NULL;
+}
+
+/*
+ * mixed: replaces random blocks, with sizes from mixed_size.
+ */
+static void *mixed(void *arg)
+{
+    worker_t *wk = arg;
+    void **blocks = wk->blocks;
+    size_t steps = wk->ops / 2;
+
+    for (size_t i = 0; i < MIXED_SLOTS; i++)
+        blocks[i] = wk->alloc->malloc(mixed_size(&wk->rng));
+
+    begin(wk);
+    for (size_t s = 0; s < steps; s++)
+    {
+        size_t i = next_rand(&wk->rng) % MIXED_SLOTS;
+
+        wk->alloc->free(blocks[i]);
+        blocks[i] = wk->alloc->malloc(mixed_size(&wk->rng));
+        if (blocks[i] != NULL)
+            *(char *) blocks[i] = 0;
+    }
+
+    wk->nblocks = MIXED_SLOTS;
+    wk->ops = 2 * steps;
+    wk->end = now();
+    return NULL;
+}
+
+/*
+ * begin: waits for every thread to be ready, then starts the thread's clock.
+ */
+static void begin(worker_t *wk)
+{
+    pthread_barrier_wait(&barrier);
+    wk->start = now();
+}
+
+/*
+ * mixed_size: returns a size of 8 to 64 bytes 80% of the time, up to 1 KiB
+ *             15%, up to 32 KiB 4%, and up to 256 KiB 1%.
+ */
+static size_t mixed_size(uint64_t *rng)
+{
+    uint64_t r = next_rand(rng);
+    unsigned int p = r % 100;
+
+    r >>= 8;
+    if (p < 80)
+        return 8 + r % 57;
+    if (p < 95)
+        return 65 + r % 960;
+    if (p < 99)
+        return 1025 + r % 31744;
+    return 32769 + r % 229376;
+}
+
+/*
+ * next_rand: returns the next number of a thread's xorshift generator.
+ */
+static uint64_t next_rand(uint64_t *rng)
+{
+    uint64_t x = *rng;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *rng = x;
+}
+
+/*
+ * rss_bytes: returns the process's resident set size.
+ */
+static size_t rss_bytes(void)
+{
+    FILE *f = fopen("/proc/self/statm", "r");
+    size_t size = 0, resident = 0;
+
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%zu %zu", &size, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * now: returns a monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,1622 @@
+/*
+ * mdriver.c - replays allocation traces against the allocator in mm.c,
+ * built with -DDRIVER, and optionally against the C library's malloc.
+ *
+ * Two trace formats are read:
+ * - Text traces (.rep), as used by the malloc lab: four header numbers
+ *   (suggested heap size, number of ids, number of ops, weight), then one
+ *   op per line: "a id size", "r id size" or "f id". Traces that check
+ *   more of mm.c than the malloc lab did may also use:
+ *     c id size        calloc
+ *     m id align size  memalign
+ *     p id align size  posix_memalign, which must fail with EINVAL exactly
+ *                      when align is not a power of two multiple of
+ *                      sizeof(void *)
+ *     s id             free_sized, with the size the id was allocated with
+ *     b id n size      mm_malloc_batch of n blocks into ids id to id + n - 1
+ *                      (malloc of each, for the C library)
+ *     B id n           mm_free_batch of ids id to id + n - 1
+ *     t n              run the ops that follow on thread n, from 0 (the
+ *                      main thread) to MAX_THREADS - 1; the other threads
+ *                      exit at the end of each run
+ *     o name value     mm_setopt, for mm.c only; value may be "max". The
+ *                      option stays set, so traces restore it at their end,
+ *                      except huge_pages, which remaps memlib's heap (while
+ *                      it is empty) and is set back to -H's at each run
+ *     k stat min max   check, in mm.c's checked run, that heap (mem_heapsize),
+ *                      mapped (mem_mapsize), extends or live (heap_extends
+ *                      or live_bytes of mm_get_stats), resident (bytes of
+ *                      the heap in resident pages) or profiled (bytes of
+ *                      the blocks in mm_prof_dump's profile) is within
+ *                      [min, max]
+ *     w ms             sleep for ms milliseconds
+ *     g n size         for mm.c only, allocate n objects of size bytes from
+ *                      a new region, reset it, allocate them again, which
+ *                      must not grow the heap, and destroy it
+ *     l n size align   the same with a pool of objects aligned to align (0
+ *                      for the default), freeing them instead of resetting
+ * - Binary traces recorded by mm_trace_start (see mm.h). Events are sorted
+ *   by timestamp and replayed on one thread; block addresses are turned
+ *   into ids, and the two halves of each realloc are joined into one op.
+ *
+ * Each trace is run three times for each allocator:
+ * - A checked run, which fills every payload with a pattern derived from
+ *   its id, checks it before each realloc and free, checks alignment and
+ *   the zeroing of calloc, checks that requests of more than PTRDIFF_MAX
+ *   bytes or alignment fail (leaving a realloc'd block in place), and
+ *   tracks the peak of live bytes. With -c it also calls mm_checkheap
+ *   after every op.
+ * - Timed runs (-n of them, the best is kept) for throughput.
+ * - A run timing every op, for latency percentiles.
+ * Utilization is peak live bytes over the peak of the bytes mm.c holds in
+ * the heap and in mappings, sampled after every op of the checked run. The
+ * C library gives no cheap equivalent, so its utilization is not reported.
+ *
+ * With -r, each trace is also replayed on mm.c while mm_trace_start
+ * records it into a temporary file, which is read back and must hold the
+ * same calls on the same blocks. Recording must leave the heap's peak as
+ * it was in the checked run, unless the trace samples for the heap
+ * profiler or runs ops on other threads.
+ *
+ * usage: mdriver [-c] [-g] [-H] [-n runs] [-p bytes] [-r] trace...
+ *   -c  call mm_checkheap after every op of the checked run
+ *   -g  also run each trace against the C library's malloc
+ *   -H  back mm.c's heap with transparent huge pages, unless a trace sets
+ *       huge_pages to 0
+ *   -n  number of timed runs, of which the fastest is reported
+ *   -p  fault in this many bytes past mm.c's heap at start-up and, in the
+ *       background, as it grows
+ *   -r  check that recording each trace with mm_trace_start round-trips
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include <time.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_THREADS 8  // Threads a text trace can run ops on
+
+/* Kinds of replayed ops */
+typedef enum op_type {
+    OP_ALLOC,          // block[id] = malloc(size)
+    OP_CALLOC,         // block[id] = calloc(1, size)
+    OP_MEMALIGN,       // block[id] = memalign(align, size)
+    OP_POSIX_MEMALIGN, // posix_memalign(&block[id], align, size)
+    OP_REALLOC,        // block[id] = realloc(block[id], size)
+    OP_FREE,           // free(block[id])
+    OP_FREE_SIZED,     // free_sized(block[id], size)
+    OP_MALLOC_BATCH,   // malloc_batch(size, count, &block[id])
+    OP_FREE_BATCH,     // free_batch(&block[id], count)
+    OP_TYPES,
+    /* Directives of text traces, which are not timed */
+    OP_SETOPT = OP_TYPES, // setopt(options[id], size)
+    OP_CHECK,             // stat_names[id] must be within [align, size]
+    OP_WAIT,              // Sleep for size milliseconds
+    OP_REGION,            // scope(): count objects of size bytes in a region
+    OP_POOL               // scope(): the same in a pool aligned to align
+} op_type_t;
+
+static const char *op_names[] = {
+    "malloc", "calloc", "memalign", "posix_memalign", "realloc", "free",
+    "free_sized", "malloc_batch", "free_batch", "setopt", "check", "wait",
+    "region", "pool"
+};
+
+typedef struct op {
+    op_type_t type;
+    size_t id;
+    size_t size;
+    size_t align;
+    size_t count;               // Blocks of a batch op, or region objects
+    unsigned int thread;        // Thread the op runs on, 0 for the main one
+} op_t;
+
+/* Options a text trace can set, by name */
+static const struct {
+    const char *name;
+    mm_option_t option;
+} options[] = {
+    { "mmap_threshold", MM_OPT_MMAP_THRESHOLD },
+    { "trim_threshold", MM_OPT_TRIM_THRESHOLD },
+    { "purge_threshold", MM_OPT_PURGE_THRESHOLD },
+    { "purge_decay_ms", MM_OPT_PURGE_DECAY_MS },
+    { "grow_max", MM_OPT_GROW_MAX },
+    { "prof_rate", MM_OPT_PROF_RATE },
+    { "huge_pages", MM_OPT_HUGE_PAGES },
+};
+#define NUM_OPTIONS (sizeof(options) / sizeof(options[0]))
+
+/* Statistics a text trace can check, by name */
+static const char *stat_names[] = {
+    "heap", "mapped", "extends", "live", "resident", "profiled"
+};
+#define NUM_STATS (sizeof(stat_names) / sizeof(stat_names[0]))
+
+typedef struct trace {
+    const char *name;
+    size_t num_ids;
+    size_t num_ops;
+    op_t *ops;
+} trace_t;
+
+/* An allocator under test */
+typedef struct allocator {
+    const char *name;
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+    void *(*memalign)(size_t alignment, size_t size);
+    int (*posix_memalign)(void **memptr, size_t alignment, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*free)(void *ptr);
+    void (*free_sized)(void *ptr, size_t size);
+    size_t (*malloc_batch)(size_t size, size_t n, void **out);
+    void (*free_batch)(void **ptrs, size_t n);
+    bool (*reset)(void);         // Starts from an empty heap
+    size_t (*footprint)(void);   // Bytes taken from the system, or NULL
+    bool (*checkheap)(int lineno);
+    bool (*setopt)(mm_option_t option, size_t value); // Or NULL
+    size_t (*stat)(size_t stat); // Value of stat_names[stat], or NULL
+    const char *(*scope)(const op_t *op); // Runs a region or pool op, or NULL
+} allocator_t;
+
+/* A thread that ops are handed to one at a time, so runs stay ordered */
+typedef struct worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         // Signals a new op, quit, or a finished op
+    const allocator_t *alloc;
+    const op_t *op;              // Op to run, NULL once it has run
+    void **blocks;
+    void *result;                // What do_op returned
+    int err;                     // errno after do_op
+    bool started;
+    bool quit;
+} worker_t;
+
+/* Results of running one trace on one allocator */
+typedef struct result {
+    bool ok;
+    double ops_per_sec;
+    size_t peak_live;
+    size_t peak_heap;
+    size_t op_count[OP_TYPES];
+    double *latency[OP_TYPES];   // Nanoseconds, sorted
+} result_t;
+
+static bool check_heap = false;  // Call mm_checkheap after every checked op
+static bool huge_heap = false;   // -H: runs start with a huge page heap
+static bool heap_is_huge = false; // How memlib's heap was last set up
+static int runs = 1;             // Timed runs per trace and allocator
+static worker_t workers[MAX_THREADS]; // workers[0] stands for the main thread
+
+static bool mm_reset(void);
+static size_t mm_footprint(void);
+static bool mm_option(mm_option_t option, size_t value);
+static size_t mm_stat(size_t stat);
+static size_t mm_resident(void);
+static size_t mm_profiled(void);
+static const char *mm_scope(const op_t *op);
+static bool libc_reset(void);
+static void libc_free_sized(void *ptr, size_t size);
+static size_t libc_malloc_batch(size_t size, size_t n, void **out);
+static void libc_free_batch(void **ptrs, size_t n);
+static bool read_trace(const char *path, trace_t *trace);
+static bool read_text_trace(FILE *f, trace_t *trace);
+static bool read_binary_trace(FILE *f, trace_t *trace);
+static bool fail(const trace_t *trace, const allocator_t *alloc, size_t i,
+                 const char *fmt, ...);
+static void free_all(const trace_t *trace, const allocator_t *alloc, void **blocks);
+static bool run_checked(const trace_t *trace, const allocator_t *alloc, result_t *res);
+static bool check_batch(const trace_t *trace, const allocator_t *alloc, size_t i,
+                        void **blocks, size_t *sizes, size_t *live);
+static bool check_after(const trace_t *trace, const allocator_t *alloc, size_t i,
+                        result_t *res, size_t live);
+static double run_timed(const trace_t *trace, const allocator_t *alloc);
+static void run_latency(const trace_t *trace, const allocator_t *alloc, result_t *res);
+static bool run_roundtrip(const trace_t *trace, const allocator_t *alloc,
+                          size_t peak_heap);
+static void *run_op(const allocator_t *alloc, const op_t *op, void **blocks);
+static void *worker_run(void *arg);
+static void stop_workers(void);
+static void *do_op(const allocator_t *alloc, const op_t *op, void **blocks);
+static bool allocates(op_type_t type);
+static bool batched(op_type_t type);
+static void fill(unsigned char *p, size_t n, size_t id);
+static bool check(const unsigned char *p, size_t n, size_t id);
+static double now(void);
+static int cmp_double(const void *a, const void *b);
+static double percentile(const double *v, size_t n, double p);
+static void report(const allocator_t *alloc, const result_t *res);
+
+static const allocator_t allocators[] = {
+    { "mm", mm_malloc, mm_calloc, mm_memalign, mm_posix_memalign, mm_realloc,
+      mm_free, mm_free_sized, mm_malloc_batch, mm_free_batch, mm_reset,
+      mm_footprint, mm_checkheap, mm_option, mm_stat, mm_scope },
+    { "libc", malloc, calloc, memalign, posix_memalign, realloc,
+      free, libc_free_sized, libc_malloc_batch, libc_free_batch, libc_reset,
+      NULL, NULL, NULL, NULL, NULL },
+};
+
+int main(int argc, char **argv)
+{
+    bool with_libc = false;
+    bool roundtrip = false;
+    bool ok = true;
+    int c;
+
+    while ((c = getopt(argc, argv, "cgHn:p:rh")) != -1)
+    {
+        switch (c)
+        {
+            case 'c': check_heap = true; break;
+            case 'g': with_libc = true; break;
+            case 'H': huge_heap = true; break;
+            case 'n': runs = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'p':
+                mm_setopt(MM_OPT_PREFAULT_SIZE, strtoul(optarg, NULL, 0));
+                mm_setopt(MM_OPT_PREFAULT_AHEAD, strtoul(optarg, NULL, 0));
+                break;
+            case 'r': roundtrip = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-c] [-g] [-H] [-n runs] [-p bytes] [-r] trace...\n", argv[0]);
+                return 2;
+        }
+    }
+    if (optind == argc)
+    {
+        fprintf(stderr, "usage: %s [-c] [-g] [-H] [-n runs] [-p bytes] [-r] trace...\n", argv[0]);
+        return 2;
+    }
+
+    mem_init(false, huge_heap);
+    heap_is_huge = huge_heap;
+
+    for (int t = optind; t < argc; t++)
+    {
+        trace_t trace;
+
+        if (!read_trace(argv[t], &trace))
+        {
+            ok = false;
+            continue;
+        }
+        printf("%s: %zu ops, %zu ids\n", trace.name, trace.num_ops, trace.num_ids);
+
+        for (size_t a = 0; a < (with_libc ? 2 : 1); a++)
+        {
+            result_t res;
+
+            memset(&res, 0, sizeof(res));
+            res.ok = run_checked(&trace, &allocators[a], &res);
+            /* Only mm.c records traces */
+            if (res.ok && roundtrip && a == 0)
+                res.ok = run_roundtrip(&trace, &allocators[a], res.peak_heap);
+            if (res.ok)
+            {
+                res.ops_per_sec = run_timed(&trace, &allocators[a]);
+                run_latency(&trace, &allocators[a], &res);
+            }
+            ok = ok && res.ok;
+            report(&allocators[a], &res);
+            for (int i = 0; i < OP_TYPES; i++)
+                free(res.latency[i]);
+        }
+        free(trace.ops);
+    }
+
+    mem_deinit();
+    return ok ? 0 : 1;
+}
+
+/*
+ * mm_reset: gives mm.c an empty heap, backed by huge pages if -H was given.
+ */
+static bool mm_reset(void)
+{
+    mem_reset_brk();
+    if (heap_is_huge != huge_heap)
+    {
+        mem_deinit();
+        mem_init(false, huge_heap);
+        heap_is_huge = huge_heap;
+    }
+    return mm_init();
+}
+
+/*
+ * mm_footprint: returns the bytes mm.c holds in the heap and in mappings.
+ */
+static size_t mm_footprint(void)
+{
+    return mem_heapsize() + mem_mapsize();
+}
+
+/*
+ * mm_option: sets an option of mm.c. memlib reserves the heap before mm.c
+ *            sees it, so huge_pages sets memlib up again instead, which
+ *            only works while the heap is empty.
+ */
+static bool mm_option(mm_option_t option, size_t value)
+{
+    if (option != MM_OPT_HUGE_PAGES)
+        return mm_setopt(option, value);
+
+    if (mm_stat(3) != 0)
+        return false;
+    mem_reset_brk();
+    mem_deinit();
+    mem_init(false, value != 0);
+    heap_is_huge = (value != 0);
+    return mm_init();
+}
+
+/*
+ * mm_stat: returns the value of stat_names[stat] for mm.c.
+ */
+static size_t mm_stat(size_t stat)
+{
+    mm_stats_t stats;
+
+    switch (stat)
+    {
+        case 0:
+            return mem_heapsize();
+        case 1:
+            return mem_mapsize();
+        case 2:
+            return mm_get_stats(&stats) ? stats.heap_extends : 0;
+        case 3:
+            return mm_get_stats(&stats) ? stats.live_bytes : 0;
+        case 4:
+            return mm_resident();
+        default:
+            return mm_profiled();
+    }
+}
+
+/*
+ * mm_resident: returns the bytes of mm.c's heap regions in resident pages.
+ */
+static size_t mm_resident(void)
+{
+    unsigned char vec[4096];
+    size_t page = mem_pagesize();
+    size_t bytes = 0;
+
+    for (unsigned int r = 0; r < MEM_MAX_REGIONS; r++)
+    {
+        unsigned char *lo = mem_region_lo(r);
+        unsigned char *hi = (unsigned char *) mem_region_hi(r) + 1;
+
+        while (lo < hi)
+        {
+            size_t n = (size_t)(hi - lo + page - 1) / page;
+            if (n > sizeof(vec))
+                n = sizeof(vec);
+            if (mincore(lo, n * page, vec) != 0)
+                break;
+            for (size_t k = 0; k < n; k++)
+                bytes += (vec[k] & 1) ? page : 0;
+            lo += n * page;
+        }
+    }
+    return bytes;
+}
+
+/*
+ * mm_profiled: returns the bytes of the sampled blocks that mm_prof_dump
+ *              writes in its profile's header, or 0 if it fails.
+ */
+static size_t mm_profiled(void)
+{
+    FILE *f = tmpfile();
+    size_t objs, bytes = 0;
+
+    if (f == NULL)
+        return 0;
+    if (!mm_prof_dump(fileno(f)) ||
+        fseek(f, 0, SEEK_SET) != 0 ||
+        fscanf(f, "heap profile: %zu: %zu", &objs, &bytes) != 2)
+        bytes = 0;
+    fclose(f);
+    return bytes;
+}
+
+/*
+ * mm_scope: runs a region or pool op. Allocates its objects, filling each
+ *           with a pattern, and checks them once all are allocated; then
+ *           frees them all, by resetting the region or one by one to the
+ *           pool, and does it again, which must not grow the heap. Returns
+ *           why the op failed, or NULL.
+ */
+static const char *mm_scope(const op_t *op)
+{
+    void **objs = calloc(op->count + 1, sizeof(void *));
+    size_t align = (op->type == OP_POOL && op->align != 0) ? op->align : 16;
+    mm_region_t *region = NULL;
+    mm_pool_t *pool = NULL;
+    const char *why = NULL;
+    size_t footprint = 0;
+
+    if (objs == NULL)
+        return "out of memory";
+    if (op->type == OP_REGION)
+        region = mm_region_create();
+    else
+        pool = mm_pool_create(op->size, op->align);
+    if (region == NULL && pool == NULL)
+        why = "cannot be created";
+
+    for (int round = 0; why == NULL && round < 2; round++)
+    {
+        for (size_t k = 0; why == NULL && k < op->count; k++)
+        {
+            objs[k] = (region != NULL) ? mm_region_alloc(region, op->size) :
+                                         mm_pool_alloc(pool);
+            if (objs[k] == NULL)
+                why = "out of memory";
+            else if ((uintptr_t) objs[k] % align != 0)
+                why = "an object is misaligned";
+            else
+                fill(objs[k], op->size, k);
+        }
+        for (size_t k = 0; why == NULL && k < op->count; k++)
+        {
+            if (!check(objs[k], op->size, k))
+                why = "objects overlap";
+        }
+        if (why == NULL && round == 0)
+            footprint = mm_footprint();
+        else if (why == NULL && mm_footprint() > footprint)
+            why = "allocating the objects again grew the heap";
+
+        if (why == NULL && region != NULL)
+            mm_region_reset(region);
+        for (size_t k = 0; why == NULL && pool != NULL && k < op->count; k++)
+            mm_pool_free(pool, objs[k]);
+    }
+
+    mm_region_destroy(region);
+    if (pool != NULL)
+        mm_pool_destroy(pool);
+    free(objs);
+    return why;
+}
+
+/*
+ * libc_reset: nothing to do; the C library's heap cannot be reset.
+ */
+static bool libc_reset(void)
+{
+    return true;
+}
+
+/*
+ * libc_free_sized: free_sized for C libraries that lack it.
+ */
+static void libc_free_sized(void *ptr, size_t size)
+{
+    (void) size;
+    free(ptr);
+}
+
+/*
+ * libc_malloc_batch: mm_malloc_batch for the C library, one malloc at a time.
+ */
+static size_t libc_malloc_batch(size_t size, size_t n, void **out)
+{
+    size_t count = 0;
+
+    while (count < n && (out[count] = malloc(size)) != NULL)
+        count++;
+    return count;
+}
+
+/*
+ * libc_free_batch: mm_free_batch for the C library, one free at a time.
+ */
+static void libc_free_batch(void **ptrs, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+/*
+ * read_trace: reads a text or binary trace, telling them apart by the
+ *             binary trace's magic number.
+ */
+static bool read_trace(const char *path, trace_t *trace)
+{
+    char magic[sizeof(((mm_trace_header_t *) 0)->magic)];
+    FILE *f = fopen(path, "rb");
+    bool ok;
+
+    memset(trace, 0, sizeof(*trace));
+    trace->name = path;
+    if (f == NULL)
+    {
+        perror(path);
+        return false;
+    }
+
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+        memcmp(magic, MM_TRACE_MAGIC, sizeof(magic)) == 0)
+        ok = read_binary_trace(f, trace);
+    else
+    {
+        rewind(f);
+        ok = read_text_trace(f, trace);
+    }
+    fclose(f);
+
+    if (!ok)
+        fprintf(stderr, "%s: malformed trace\n", path);
+    return ok;
+}
+
+/*
+ * read_text_trace: reads a malloc lab trace, with the extensions described
+ *                  at the top of this file.
+ */
+static bool read_text_trace(FILE *f, trace_t *trace)
+{
+    size_t heap_size, weight, cap;
+    size_t *sizes = NULL;       // Size each id was last allocated with
+    unsigned int thread = 0;    // Thread of the ops that follow
+    char name[32], value[32];
+    bool ok = true;
+    char type;
+    op_t op;
+
+    if (fscanf(f, "%zu %zu %zu %zu", &heap_size, &trace->num_ids, &cap, &weight) != 4)
+        return false;
+
+    cap = (cap > 0) ? cap : 1;
+    if ((trace->ops = malloc(cap * sizeof(op_t))) == NULL ||
+        (sizes = calloc(trace->num_ids + 1, sizeof(size_t))) == NULL)
+        goto fail;
+
+    while (fscanf(f, " %c", &type) == 1)
+    {
+        memset(&op, 0, sizeof(op));
+        op.thread = thread;
+        switch (type)
+        {
+            case 'a':
+            case 'c':
+                op.type = (type == 'a') ? OP_ALLOC : OP_CALLOC;
+                ok = fscanf(f, "%zu %zu", &op.id, &op.size) == 2;
+                break;
+            case 'm':
+            case 'p':
+                op.type = (type == 'm') ? OP_MEMALIGN : OP_POSIX_MEMALIGN;
+                ok = fscanf(f, "%zu %zu %zu", &op.id, &op.align, &op.size) == 3;
+                break;
+            case 'r':
+                op.type = OP_REALLOC;
+                ok = fscanf(f, "%zu %zu", &op.id, &op.size) == 2;
+                break;
+            case 'f':
+            case 's':
+                op.type = (type == 'f') ? OP_FREE : OP_FREE_SIZED;
+                ok = fscanf(f, "%zu", &op.id) == 1 && op.id < trace->num_ids;
+                if (ok && type == 's')
+                    op.size = sizes[op.id];
+                break;
+            case 'b':
+                op.type = OP_MALLOC_BATCH;
+                ok = fscanf(f, "%zu %zu %zu", &op.id, &op.count, &op.size) == 3;
+                break;
+            case 'B':
+                op.type = OP_FREE_BATCH;
+                ok = fscanf(f, "%zu %zu", &op.id, &op.count) == 2;
+                break;
+            case 't':
+                ok = fscanf(f, "%u", &thread) == 1 && thread < MAX_THREADS;
+                continue;
+            case 'o':
+                op.type = OP_SETOPT;
+                ok = fscanf(f, "%31s %31s", name, value) == 2;
+                while (ok && op.id < NUM_OPTIONS && strcmp(name, options[op.id].name) != 0)
+                    op.id++;
+                ok = ok && op.id < NUM_OPTIONS;
+                if (ok)
+                    op.size = (strcmp(value, "max") == 0) ? SIZE_MAX : strtoul(value, NULL, 0);
+                break;
+            case 'k':
+                op.type = OP_CHECK;
+                ok = fscanf(f, "%31s %zu %zu", name, &op.align, &op.size) == 3;
+                while (ok && op.id < NUM_STATS && strcmp(name, stat_names[op.id]) != 0)
+                    op.id++;
+                ok = ok && op.id < NUM_STATS;
+                break;
+            case 'w':
+                op.type = OP_WAIT;
+                ok = fscanf(f, "%zu", &op.size) == 1;
+                break;
+            case 'g':
+                op.type = OP_REGION;
+                ok = fscanf(f, "%zu %zu", &op.count, &op.size) == 2;
+                break;
+            case 'l':
+                op.type = OP_POOL;
+                ok = fscanf(f, "%zu %zu %zu", &op.count, &op.size, &op.align) == 3;
+                break;
+            default:
+                ok = false;
+        }
+        if (!ok || (op.type < OP_TYPES && op.id >= trace->num_ids) ||
+            (batched(op.type) && op.count > trace->num_ids - op.id))
+            goto fail;
+        if (allocates(op.type) || op.type == OP_REALLOC)
+            sizes[op.id] = op.size;
+        for (size_t k = 0; op.type == OP_MALLOC_BATCH && k < op.count; k++)
+            sizes[op.id + k] = op.size;
+
+        if (trace->num_ops == cap)
+        {
+            op_t *ops = realloc(trace->ops, 2 * cap * sizeof(op_t));
+            if (ops == NULL)
+                goto fail;
+            trace->ops = ops;
+            cap *= 2;
+        }
+        trace->ops[trace->num_ops++] = op;
+    }
+
+    free(sizes);
+    return true;
+
+fail:
+    free(sizes);
+    free(trace->ops);
+    trace->ops = NULL;
+    trace->num_ops = 0;
+    return false;
+}
+
+/* Hash table entry mapping a live block address to its id */
+typedef struct id_slot {
+    uint64_t ptr;               // 0 if empty
+    size_t id;
+} id_slot_t;
+
+/*
+ * id_find: returns the slot of ptr in an open-addressing table of size n,
+ *          a power of two, or the empty slot where it would go.
+ */
+static id_slot_t *id_find(id_slot_t *table, size_t n, uint64_t ptr)
+{
+    size_t i = (size_t)((ptr >> 4) * 0x9E3779B97F4A7C15ULL) & (n - 1);
+
+    while (table[i].ptr != 0 && table[i].ptr != ptr)
+        i = (i + 1) & (n - 1);
+    return &table[i];
+}
+
+/*
+ * id_remove: removes a slot from the table, moving later entries of its
+ *            probe sequence back so lookups still find them.
+ */
+static void id_remove(id_slot_t *table, size_t n, id_slot_t *slot)
+{
+    size_t i = slot - table;
+    size_t j = i;
+
+    table[i].ptr = 0;
+    for (;;)
+    {
+        j = (j + 1) & (n - 1);
+        if (table[j].ptr == 0)
+            return;
+        size_t home = (size_t)((table[j].ptr >> 4) * 0x9E3779B97F4A7C15ULL) & (n - 1);
+        /* Move j to i unless its home lies cyclically in (i, j] */
+        if ((i <= j) ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        table[i] = table[j];
+        table[j].ptr = 0;
+        i = j;
+    }
+}
+
+
+/* One call from a binary trace, with the halves of a realloc joined */
+typedef struct record {
+    uint64_t time;              // When the call returned
+    uint64_t seq;               // Position in the file, to order ties
+    uint64_t old;               // Block passed to realloc or free
+    uint64_t ptr;               // Block returned
+    uint64_t size;
+    uint8_t op;
+    uint8_t align_log2;
+} record_t;
+
+static int cmp_record(const void *a, const void *b)
+{
+    const record_t *x = a;
+    const record_t *y = b;
+    if (x->time != y->time)
+        return (x->time > y->time) - (x->time < y->time);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/*
+ * read_binary_trace: reads a trace recorded by mm_trace_start. Calls that
+ *                    do not fit the sequence, such as frees of blocks
+ *                    allocated before recording started, or realloc halves
+ *                    whose partner was dropped, are skipped and counted.
+ */
+static bool read_binary_trace(FILE *f, trace_t *trace)
+{
+    mm_trace_header_t header;
+    mm_trace_event_t event;
+    record_t *records = NULL;
+    record_t *pending = NULL;   // Unmatched realloc start of each thread
+    size_t num_records = 0, cap = 0, num_threads = 0, skipped = 0;
+    size_t table_size = 16;
+    id_slot_t *table = NULL;
+    id_slot_t *slot;
+    bool ok = false;
+
+    rewind(f);
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        header.version != MM_TRACE_VERSION ||
+        header.event_size != sizeof(mm_trace_event_t))
+        return false;
+
+    /* A thread's events are in order in the file, so each realloc start
+       is joined with the next event of its thread */
+    while (fread(&event, sizeof(event), 1, f) == 1)
+    {
+        record_t *r;
+
+        if (event.thread >= num_threads)
+        {
+            size_t n = 2 * event.thread + 16;
+            if ((r = realloc(pending, n * sizeof(record_t))) == NULL)
+                goto out;
+            memset(r + num_threads, 0, (n - num_threads) * sizeof(record_t));
+            pending = r;
+            num_threads = n;
+        }
+        if (pending[event.thread].op != 0)
+        {
+            pending[event.thread].op = 0;
+            if (event.op != MM_TRACE_REALLOC)
+                skipped++;
+        }
+        else if (event.op == MM_TRACE_REALLOC)
+        {
+            skipped++;
+            continue;
+        }
+
+        if (event.op == MM_TRACE_REALLOC_FROM)
+        {
+            pending[event.thread].op = event.op;
+            pending[event.thread].old = event.ptr;
+            continue;
+        }
+
+        if (num_records == cap)
+        {
+            cap = (cap != 0) ? 2 * cap : 1 << 16;
+            if ((r = realloc(records, cap * sizeof(record_t))) == NULL)
+                goto out;
+            records = r;
+        }
+        r = &records[num_records];
+        r->seq = num_records++;
+        r->time = event.time;
+        r->old = (event.op == MM_TRACE_FREE) ? event.ptr :
+                 (event.op == MM_TRACE_REALLOC) ? pending[event.thread].old : 0;
+        r->ptr = (event.op == MM_TRACE_FREE) ? 0 : event.ptr;
+        r->size = event.size;
+        r->op = event.op;
+        r->align_log2 = event.align_log2;
+    }
+
+    qsort(records, num_records, sizeof(record_t), cmp_record);
+
+    while (table_size < 2 * num_records)
+        table_size *= 2;
+    if ((table = calloc(table_size, sizeof(id_slot_t))) == NULL ||
+        (trace->ops = malloc((num_records + 1) * sizeof(op_t))) == NULL)
+        goto out;
+
+    /* Give each block an id, ending it at free or at a moving realloc */
+    for (size_t i = 0; i < num_records; i++)
+    {
+        record_t *r = &records[i];
+        op_t *op = &trace->ops[trace->num_ops];
+        size_t id = 0;
+
+        if (r->old != 0)
+        {
+            slot = id_find(table, table_size, r->old);
+            if (slot->ptr == 0)
+            {
+                skipped++;
+                continue;
+            }
+            id = slot->id;
+            /* A failed realloc leaves the block where it was */
+            if (r->op == MM_TRACE_REALLOC && r->ptr == 0 && r->size != 0)
+                continue;
+            id_remove(table, table_size, slot);
+        }
+        else if (r->op == MM_TRACE_FREE || r->ptr == 0)
+            continue;
+        else
+            id = trace->num_ids++;
+
+        if (r->ptr != 0)
+        {
+            slot = id_find(table, table_size, r->ptr);
+            if (slot->ptr != 0)
+                skipped++;      // Its free was lost; the old id stays live
+            slot->ptr = r->ptr;
+            slot->id = id;
+        }
+
+        op->id = id;
+        op->size = r->size;
+        op->align = (size_t) 1 << r->align_log2;
+        switch (r->op)
+        {
+            case MM_TRACE_MALLOC:   op->type = OP_ALLOC; break;
+            case MM_TRACE_CALLOC:   op->type = OP_CALLOC; break;
+            case MM_TRACE_MEMALIGN: op->type = OP_MEMALIGN; break;
+            case MM_TRACE_REALLOC:  op->type = OP_REALLOC; break;
+            case MM_TRACE_FREE:     op->type = OP_FREE; break;
+            default:
+                skipped++;
+                continue;
+        }
+        trace->num_ops++;
+    }
+    ok = true;
+
+    if (skipped != 0)
+        fprintf(stderr, "%s: skipped %zu inconsistent events\n", trace->name, skipped);
+
+out:
+    free(records);
+    free(pending);
+    free(table);
+    return ok;
+}
+
+/*
+ * fail: reports a failed op and returns false.
+ */
+static bool fail(const trace_t *trace, const allocator_t *alloc, size_t i,
+                 const char *fmt, ...)
+{
+    va_list ap;
+
+    fprintf(stderr, "%s: %s: op %zu (%s id %zu size %zu): ", trace->name,
+            alloc->name, i, op_names[trace->ops[i].type], trace->ops[i].id,
+            trace->ops[i].size);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    return false;
+}
+
+/*
+ * free_all: frees the blocks a run left allocated.
+ */
+static void free_all(const trace_t *trace, const allocator_t *alloc, void **blocks)
+{
+    for (size_t id = 0; id < trace->num_ids; id++)
+    {
+        if (blocks[id] != NULL)
+            alloc->free(blocks[id]);
+    }
+}
+
+/*
+ * run_checked: runs a trace, checking every block returned and the payload
+ *              of every block before it is reallocated or freed. Records the
+ *              peaks of live bytes and of the heap's footprint.
+ */
+static bool run_checked(const trace_t *trace, const allocator_t *alloc, result_t *res)
+{
+    void **blocks = calloc(trace->num_ids + 1, sizeof(void *));
+    size_t *sizes = calloc(trace->num_ids + 1, sizeof(size_t));
+    size_t live = 0;
+    bool ok = (blocks != NULL && sizes != NULL);
+
+    if (ok && !alloc->reset())
+        ok = fail(trace, alloc, 0, "reset failed");
+
+    for (size_t i = 0; ok && i < trace->num_ops; i++)
+    {
+        const op_t *op = &trace->ops[i];
+        unsigned char *old;
+        size_t oldsize;
+        size_t align = (op->align > 16) ? op->align : 16;
+        bool huge = op->size > PTRDIFF_MAX || op->align > PTRDIFF_MAX; // Must fail
+        unsigned char *p;
+        int err;
+
+        if (op->type == OP_SETOPT)
+        {
+            if (alloc->setopt != NULL && !alloc->setopt(options[op->id].option, op->size))
+                ok = fail(trace, alloc, i, "%s %zu was rejected",
+                          options[op->id].name, op->size);
+            continue;
+        }
+        if (op->type == OP_CHECK)
+        {
+            size_t v = (alloc->stat != NULL) ? alloc->stat(op->id) : 0;
+            if (alloc->stat != NULL && (v < op->align || v > op->size))
+                ok = fail(trace, alloc, i, "%s is %zu, not in [%zu, %zu]",
+                          stat_names[op->id], v, op->align, op->size);
+            continue;
+        }
+        if (op->type == OP_REGION || op->type == OP_POOL)
+        {
+            const char *why = (alloc->scope != NULL) ? alloc->scope(op) : NULL;
+            if (why != NULL)
+                ok = fail(trace, alloc, i, "%s", why);
+            ok = ok && check_after(trace, alloc, i, res, live);
+            continue;
+        }
+        if (op->type == OP_WAIT)
+        {
+            do_op(alloc, op, blocks);
+            continue;
+        }
+        if (batched(op->type))
+        {
+            res->op_count[op->type]++;
+            ok = check_batch(trace, alloc, i, blocks, sizes, &live) &&
+                 check_after(trace, alloc, i, res, live);
+            continue;
+        }
+
+        old = blocks[op->id];
+        oldsize = sizes[op->id];
+        if (allocates(op->type) && old != NULL)
+        {
+            ok = fail(trace, alloc, i, "id is already allocated");
+            break;
+        }
+        if (old != NULL && !check(old, oldsize, op->id))
+        {
+            ok = fail(trace, alloc, i, "payload of %p was overwritten", old);
+            break;
+        }
+
+        p = run_op(alloc, op, blocks);
+        err = errno;
+        res->op_count[op->type]++;
+
+        if (op->type == OP_POSIX_MEMALIGN)
+        {
+            bool valid = op->align != 0 && op->align % sizeof(void *) == 0 &&
+                         (op->align & (op->align - 1)) == 0;
+            if (err != (!valid ? EINVAL : huge ? ENOMEM : 0))
+            {
+                ok = fail(trace, alloc, i, "returned %d for alignment %zu",
+                          err, op->align);
+                break;
+            }
+        }
+
+        if ((allocates(op->type) || op->type == OP_REALLOC) && huge)
+        {
+            if (p != NULL)
+            {
+                ok = fail(trace, alloc, i, "%p was returned for %zu bytes", p, op->size);
+                break;
+            }
+        }
+        else if ((allocates(op->type) || op->type == OP_REALLOC) && op->size != 0 &&
+                 !(op->type == OP_POSIX_MEMALIGN && err == EINVAL))
+        {
+            if (p == NULL)
+                ok = fail(trace, alloc, i, "out of memory");
+            else if ((uintptr_t) p % align != 0)
+                ok = fail(trace, alloc, i, "%p is not %zu-byte aligned", p, align);
+            else if (op->type == OP_CALLOC &&
+                     !(p[0] == 0 && memcmp(p, p + 1, op->size - 1) == 0))
+                ok = fail(trace, alloc, i, "%p is not zeroed", p);
+            else if (op->type == OP_REALLOC &&
+                     !check(p, (oldsize < op->size) ? oldsize : op->size, op->id))
+                ok = fail(trace, alloc, i, "realloc to %p lost the payload", p);
+            if (!ok)
+                break;
+            fill(p, op->size, op->id);
+        }
+
+        if (p != NULL || op->type != OP_REALLOC || op->size == 0)
+        {
+            live -= oldsize;
+            sizes[op->id] = (p != NULL) ? op->size : 0;
+            live += sizes[op->id];
+        }
+        ok = check_after(trace, alloc, i, res, live);
+    }
+
+    stop_workers();
+    if (blocks != NULL)
+        free_all(trace, alloc, blocks);
+    free(blocks);
+    free(sizes);
+    return ok;
+}
+
+/*
+ * check_batch: runs op i, a batch op, for run_checked. The blocks of a
+ *              malloc batch must all be allocated, aligned and apart; the
+ *              payloads of a free batch must be intact.
+ */
+static bool check_batch(const trace_t *trace, const allocator_t *alloc, size_t i,
+                        void **blocks, size_t *sizes, size_t *live)
+{
+    const op_t *op = &trace->ops[i];
+    size_t end = op->id + op->count;
+
+    for (size_t id = op->id; id < end; id++)
+    {
+        if (op->type == OP_MALLOC_BATCH && blocks[id] != NULL)
+            return fail(trace, alloc, i, "id %zu is already allocated", id);
+        if (blocks[id] != NULL && !check(blocks[id], sizes[id], id))
+            return fail(trace, alloc, i, "payload of %p was overwritten", blocks[id]);
+    }
+
+    run_op(alloc, op, blocks);
+
+    for (size_t id = op->id; id < end; id++)
+    {
+        unsigned char *p = blocks[id];
+
+        *live -= sizes[id];
+        sizes[id] = 0;
+        if (op->type == OP_FREE_BATCH)
+            continue;
+        if (p == NULL)
+            return fail(trace, alloc, i, "out of memory at id %zu", id);
+        if ((uintptr_t) p % 16 != 0)
+            return fail(trace, alloc, i, "%p is not 16-byte aligned", p);
+        fill(p, op->size, id);
+        sizes[id] = op->size;
+        *live += op->size;
+    }
+    for (size_t id = op->id; op->type == OP_MALLOC_BATCH && id < end; id++)
+    {
+        if (!check(blocks[id], op->size, id))
+            return fail(trace, alloc, i, "%p overlaps another block", blocks[id]);
+    }
+    return true;
+}
+
+/*
+ * check_after: records the peaks of live bytes and of the heap's footprint
+ *              after op i of run_checked, and checks the heap if asked to.
+ */
+static bool check_after(const trace_t *trace, const allocator_t *alloc, size_t i,
+                        result_t *res, size_t live)
+{
+    if (live > res->peak_live)
+        res->peak_live = live;
+
+    if (alloc->footprint != NULL && alloc->footprint() > res->peak_heap)
+        res->peak_heap = alloc->footprint();
+    if (check_heap && alloc->checkheap != NULL && !alloc->checkheap(__LINE__))
+        return fail(trace, alloc, i, "heap check failed");
+    return true;
+}
+
+/*
+ * run_timed: runs a trace without checks and returns the best throughput,
+ *            in ops per second, of the timed runs.
+ */
+static double run_timed(const trace_t *trace, const allocator_t *alloc)
+{
+    void **blocks = calloc(trace->num_ids + 1, sizeof(void *));
+    double best = 0;
+
+    if (blocks == NULL)
+        return 0;
+
+    for (int r = 0; r < runs; r++)
+    {
+        double start, secs;
+
+        memset(blocks, 0, trace->num_ids * sizeof(void *));
+        if (!alloc->reset())
+            break;
+
+        start = now();
+        for (size_t i = 0; i < trace->num_ops; i++)
+            run_op(alloc, &trace->ops[i], blocks);
+        secs = now() - start;
+
+        stop_workers();
+        free_all(trace, alloc, blocks);
+        if (secs > 0 && trace->num_ops / secs > best)
+            best = trace->num_ops / secs;
+    }
+
+    free(blocks);
+    return best;
+}
+
+/*
+ * run_latency: runs a trace timing each op, and leaves each op type's
+ *              latencies sorted in res.
+ */
+static void run_latency(const trace_t *trace, const allocator_t *alloc, result_t *res)
+{
+    void **blocks = calloc(trace->num_ids + 1, sizeof(void *));
+    size_t n[OP_TYPES] = {0};
+
+    if (blocks == NULL || !alloc->reset())
+    {
+        free(blocks);
+        return;
+    }
+    for (int t = 0; t < OP_TYPES; t++)
+        res->latency[t] = malloc((res->op_count[t] + 1) * sizeof(double));
+
+    for (size_t i = 0; i < trace->num_ops; i++)
+    {
+        const op_t *op = &trace->ops[i];
+        double start = now();
+
+        run_op(alloc, op, blocks);
+        if (op->type < OP_TYPES && res->latency[op->type] != NULL &&
+            n[op->type] < res->op_count[op->type])
+            res->latency[op->type][n[op->type]++] = (now() - start) * 1e9;
+    }
+
+    stop_workers();
+    free_all(trace, alloc, blocks);
+    free(blocks);
+    for (int t = 0; t < OP_TYPES; t++)
+    {
+        if (res->latency[t] != NULL)
+            qsort(res->latency[t], n[t], sizeof(double), cmp_double);
+        res->op_count[t] = n[t];
+    }
+}
+
+/*
+ * run_roundtrip: replays a trace on mm.c while recording it with
+ *                mm_trace_start into a temporary file, then reads the
+ *                recording back. It must hold the calls that were made, in
+ *                order, with their sizes and alignments, on the same blocks:
+ *                posix_memalign is recorded as memalign and free_sized as
+ *                free, and calls that neither allocate nor free a block are
+ *                not recorded at all. Recording must not change the heap,
+ *                so its peak must be the checked run's, peak_heap, unless
+ *                the trace samples for the heap profiler, whose draws
+ *                differ from run to run, or runs ops on other threads,
+ *                which may be given other arenas than in that run.
+ */
+static bool run_roundtrip(const trace_t *trace, const allocator_t *alloc,
+                          size_t peak_heap)
+{
+    void **blocks = calloc(trace->num_ids + 1, sizeof(void *));
+    size_t *ids = calloc(trace->num_ids + 1, sizeof(size_t)); // Recorded ids
+    size_t calls = 0;           // Calls recorded at most, a batch's blocks each
+    op_t *want;
+    size_t *from;               // Op of each call in want
+    size_t num_want = 0, next_id = 0, dropped;
+    size_t peak = 0;
+    bool varies = false;        // The peak may differ from peak_heap
+    FILE *f = tmpfile();
+    trace_t got;
+    bool ok;
+
+    for (size_t i = 0; i < trace->num_ops; i++)
+        calls += batched(trace->ops[i].type) ? trace->ops[i].count : 1;
+    want = malloc((calls + 1) * sizeof(op_t));
+    from = malloc((calls + 1) * sizeof(size_t));
+    ok = (blocks != NULL && ids != NULL && want != NULL && from != NULL &&
+          f != NULL);
+
+    memset(&got, 0, sizeof(got));
+    got.name = trace->name;
+    if (ok && (!alloc->reset() || !mm_trace_start(fileno(f))))
+        ok = fail(trace, alloc, 0, "cannot start recording");
+
+    for (size_t i = 0; ok && i < trace->num_ops; i++)
+    {
+        const op_t *op = &trace->ops[i];
+        void *old;
+        void *p;
+
+        varies = varies || op->thread != 0;
+        if (op->type >= OP_TYPES)
+        {
+            if (op->type == OP_SETOPT && options[op->id].option == MM_OPT_PROF_RATE)
+                varies = varies || op->size != 0;
+            run_op(alloc, op, blocks);
+            if (alloc->footprint() > peak)
+                peak = alloc->footprint();
+            continue;
+        }
+        if (batched(op->type))
+        {
+            /* A batch is recorded as a malloc or free of each block */
+            if (op->type == OP_MALLOC_BATCH)
+                run_op(alloc, op, blocks);
+            for (size_t id = op->id; id < op->id + op->count; id++)
+            {
+                if (blocks[id] == NULL)
+                    continue;
+                want[num_want] = *op;
+                want[num_want].type = (op->type == OP_MALLOC_BATCH) ? OP_ALLOC : OP_FREE;
+                want[num_want].size = (op->type == OP_MALLOC_BATCH) ? op->size : 0;
+                if (op->type == OP_MALLOC_BATCH)
+                    ids[id] = next_id++;
+                want[num_want].id = ids[id];
+                from[num_want++] = i;
+            }
+            if (op->type == OP_FREE_BATCH)
+                run_op(alloc, op, blocks);
+            if (alloc->footprint() > peak)
+                peak = alloc->footprint();
+            continue;
+        }
+        old = blocks[op->id];
+        p = run_op(alloc, op, blocks);
+        if (alloc->footprint() > peak)
+            peak = alloc->footprint();
+
+        /* Leave out what is not recorded, or dropped when read back */
+        if (old == NULL && (p == NULL || op->type == OP_FREE ||
+                            op->type == OP_FREE_SIZED))
+            continue;
+        if (op->type == OP_REALLOC && old != NULL && p == NULL && op->size != 0)
+            continue;
+
+        want[num_want] = *op;
+        want[num_want].type = (op->type == OP_POSIX_MEMALIGN) ? OP_MEMALIGN :
+                              (op->type == OP_FREE_SIZED) ? OP_FREE : op->type;
+        if (op->type == OP_FREE)
+            want[num_want].size = 0;
+        if (old == NULL)
+            ids[op->id] = next_id++;
+        want[num_want].id = ids[op->id];
+        from[num_want++] = i;
+    }
+    stop_workers();
+
+    if (f != NULL && (dropped = mm_trace_stop()) != 0 && ok)
+        ok = fail(trace, alloc, 0, "%zu events were dropped", dropped);
+    if (blocks != NULL)
+        free_all(trace, alloc, blocks);
+    if (ok && !read_binary_trace(f, &got))
+        ok = fail(trace, alloc, 0, "the recording cannot be read");
+    if (ok && !varies && peak != peak_heap)
+        ok = fail(trace, alloc, 0, "the heap peaked at %zu bytes while recording, "
+                  "not %zu", peak, peak_heap);
+    if (ok && got.num_ops != num_want)
+        ok = fail(trace, alloc, 0, "%zu calls were recorded, not %zu",
+                  got.num_ops, num_want);
+
+    for (size_t k = 0; ok && k < num_want; k++)
+    {
+        const op_t *g = &got.ops[k];
+        const op_t *w = &want[k];
+
+        if (g->type != w->type || g->id != w->id || g->size != w->size ||
+            (w->type == OP_MEMALIGN && g->align != w->align))
+            ok = fail(trace, alloc, from[k], "recorded as %s id %zu size %zu",
+                      op_names[g->type], g->id, g->size);
+    }
+
+    if (ok)
+        printf("  %-5s trace round trip: %zu calls\n", alloc->name, num_want);
+    if (f != NULL)
+        fclose(f);
+    free(got.ops);
+    free(blocks);
+    free(ids);
+    free(want);
+    free(from);
+    return ok;
+}
+
+/*
+ * run_op: performs one op on the thread it belongs to, starting that
+ *         thread if needed, and returns what do_op returned. errno is
+ *         left as the op left it.
+ */
+static void *run_op(const allocator_t *alloc, const op_t *op, void **blocks)
+{
+    worker_t *w = &workers[op->thread];
+    void *p;
+
+    if (op->thread == 0)
+        return do_op(alloc, op, blocks);
+
+    if (!w->started)
+    {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        w->op = NULL;
+        w->quit = false;
+        if (pthread_create(&w->thread, NULL, worker_run, w) != 0)
+        {
+            fprintf(stderr, "cannot start thread %u\n", op->thread);
+            exit(1);
+        }
+        w->started = true;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    w->alloc = alloc;
+    w->blocks = blocks;
+    w->op = op;
+    pthread_cond_broadcast(&w->cond);
+    while (w->op != NULL)
+        pthread_cond_wait(&w->cond, &w->lock);
+    p = w->result;
+    errno = w->err;
+    pthread_mutex_unlock(&w->lock);
+    return p;
+}
+
+/*
+ * worker_run: body of a worker thread. Runs the ops handed to it until
+ *             told to quit.
+ */
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (w->op == NULL && !w->quit)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (w->op == NULL)
+            break;
+        w->result = do_op(w->alloc, w->op, w->blocks);
+        w->err = errno;
+        w->op = NULL;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * stop_workers: makes the worker threads exit and waits for them, so that
+ *               their thread caches go back to the heap before it is reset.
+ */
+static void stop_workers(void)
+{
+    for (unsigned int t = 1; t < MAX_THREADS; t++)
+    {
+        worker_t *w = &workers[t];
+
+        if (!w->started)
+            continue;
+        pthread_mutex_lock(&w->lock);
+        w->quit = true;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->cond);
+        w->started = false;
+    }
+}
+
+/*
+ * do_op: performs one op, updating blocks, and returns the block it
+ *        allocated, if any (the first, for a batch). A failed realloc leaves the old block at the
+ *        op's id. posix_memalign's result is left in errno.
+ */
+static void *do_op(const allocator_t *alloc, const op_t *op, void **blocks)
+{
+    struct timespec ts;
+    void *p;
+
+    switch (op->type)
+    {
+        case OP_ALLOC:
+            return blocks[op->id] = alloc->malloc(op->size);
+        case OP_CALLOC:
+            return blocks[op->id] = alloc->calloc(1, op->size);
+        case OP_MEMALIGN:
+            return blocks[op->id] = alloc->memalign(op->align, op->size);
+        case OP_POSIX_MEMALIGN:
+            errno = alloc->posix_memalign(&blocks[op->id], op->align, op->size);
+            return blocks[op->id];
+        case OP_REALLOC:
+            p = alloc->realloc(blocks[op->id], op->size);
+            if (p != NULL || op->size == 0) // A failed realloc keeps the block
+                blocks[op->id] = p;
+            return p;
+        case OP_FREE:
+            alloc->free(blocks[op->id]);
+            return blocks[op->id] = NULL;
+        case OP_FREE_SIZED:
+            alloc->free_sized(blocks[op->id], op->size);
+            return blocks[op->id] = NULL;
+        case OP_MALLOC_BATCH:
+            alloc->malloc_batch(op->size, op->count, &blocks[op->id]);
+            return blocks[op->id];
+        case OP_FREE_BATCH:
+            /* mm_free_batch sorts the pointers, which are dropped anyway */
+            alloc->free_batch(&blocks[op->id], op->count);
+            memset(&blocks[op->id], 0, op->count * sizeof(void *));
+            return NULL;
+        case OP_SETOPT:
+            if (alloc->setopt != NULL)
+                alloc->setopt(options[op->id].option, op->size);
+            return NULL;
+        case OP_WAIT:
+            ts.tv_sec = op->size / 1000;
+            ts.tv_nsec = (long)(op->size % 1000) * 1000000;
+            nanosleep(&ts, NULL);
+            return NULL;
+        case OP_REGION:
+        case OP_POOL:
+            if (alloc->scope != NULL)
+                alloc->scope(op);
+            return NULL;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * allocates: returns whether an op of this type allocates a new block.
+ */
+static bool allocates(op_type_t type)
+{
+    return type == OP_ALLOC || type == OP_CALLOC || type == OP_MEMALIGN ||
+           type == OP_POSIX_MEMALIGN;
+}
+
+/*
+ * batched: returns whether an op of this type works on a run of ids.
+ */
+static bool batched(op_type_t type)
+{
+    return type == OP_MALLOC_BATCH || type == OP_FREE_BATCH;
+}
+
+/*
+ * fill: writes the pattern of block id to a payload of n bytes.
+ */
+static void fill(unsigned char *p, size_t n, size_t id)
+{
+    uint64_t x = id * 0x9E3779B97F4A7C15ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8, x++)
+        memcpy(p + i, &x, 8);
+    for (; i < n; i++)
+        p[i] = (unsigned char)(x >> (8 * (i % 8)));
+}
+
+/*
+ * check: returns whether the first n bytes of a payload hold the pattern
+ *        of block id.
+ */
+static bool check(const unsigned char *p, size_t n, size_t id)
+{
+    uint64_t x = id * 0x9E3779B97F4A7C15ULL;
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8, x++)
+    {
+        if (memcmp(p + i, &x, 8) != 0)
+            return false;
+    }
+    for (; i < n; i++)
+    {
+        if (p[i] != (unsigned char)(x >> (8 * (i % 8))))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * now: returns a monotonic time in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * percentile: returns the p-th percentile of n sorted values.
+ */
+static double percentile(const double *v, size_t n, double p)
+{
+    size_t i = (size_t)(p / 100 * n);
+
+    if (n == 0)
+        return 0;
+    return v[(i < n) ? i : n - 1];
+}
+
+/*
+ * report: prints the results of one trace on one allocator.
+ */
+static void report(const allocator_t *alloc, const result_t *res)
+{
+    static const double points[] = { 50, 90, 99, 99.9 };
+    size_t total = 0;
+    double *all;
+
+    if (!res->ok)
+    {
+        printf("  %-5s FAILED\n", alloc->name);
+        return;
+    }
+
+    printf("  %-5s %12.0f ops/sec  peak live %zu", alloc->name,
+           res->ops_per_sec, res->peak_live);
+    if (alloc->footprint != NULL && res->peak_heap != 0)
+        printf("  peak heap %zu  util %.1f%%\n", res->peak_heap,
+               100.0 * res->peak_live / res->peak_heap);
+    else
+        printf("  peak heap n/a\n");
+
+    /* Merge the per-type latencies for the overall line */
+    for (int t = 0; t < OP_TYPES; t++)
+        total += res->op_count[t];
+    if (total == 0 || (all = malloc(total * sizeof(double))) == NULL)
+        return;
+    total = 0;
+    for (int t = 0; t < OP_TYPES; t++)
+    {
+        if (res->latency[t] != NULL)
+        {
+            memcpy(all + total, res->latency[t], res->op_count[t] * sizeof(double));
+            total += res->op_count[t];
+        }
+    }
+    qsort(all, total, sizeof(double), cmp_double);
+
+    printf("        %-14s %10s %8s %8s %8s %8s %8s  (ns)\n", "op", "count",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (int t = -1; t < OP_TYPES; t++)
+    {
+        const double *v = (t < 0) ? all : res->latency[t];
+        size_t n = (t < 0) ? total : res->op_count[t];
+
+        if (n == 0)
+            continue;
+        printf("        %-14s %10zu", (t < 0) ? "all" : op_names[t], n);
+        for (size_t k = 0; k < sizeof(points) / sizeof(points[0]); k++)
+            printf(" %8.0f", percentile(v, n, points[k]));
+        printf(" %8.0f\n", v[n - 1]);
+    }
+    free(all);
+}
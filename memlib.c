@@ -4,7 +4,36 @@
  * package with the system's malloc package in libc.
  *
  * This version has been updated to enable sparse emulation of very large heaps
+ *
+ * The heap is split into MEM_MAX_REGIONS regions, each with its own break.
+ * Region 0 is the main heap and grows upward from the start of the heap.
+ * Regions 1 and up have fixed positions, carved downward from the top of
+ * the heap, so the region of an address is a simple computation. A
+ * secondary region is activated by its first mem_region_sbrk, after which
+ * the main heap may not grow into it.
+ *
+ * Blocks too large for the heap get mappings of their own, through
+ * mem_map, mem_remap and mem_unmap.
+ *
+ * Memory goes back to the system in two ways: mem_region_trim lowers a
+ * region's break, and mem_purge drops the pages inside a range of the heap
+ * that is not in use, which then read as zero.
+ *
+ * In dense mode the whole heap is reserved up front as inaccessible address
+ * space.  Each region commits memory ahead of its break in granules of
+ * COMMIT_GRANULE bytes, so most calls to mem_region_sbrk make no system
+ * call at all.  Committed memory stays committed until mem_reset_brk, even
+ * when the break is lowered; trimmed pages are only dropped.
+ *
+ * With huge pages, the dense heap and its regions are aligned to
+ * HUGE_PAGE_SIZE and advised with MADV_HUGEPAGE, memory is committed in
+ * huge page granules, and trimming and purging only drop whole huge pages,
+ * so the kernel's transparent huge pages are never split.
+ *
+ * mem_region_prefault commits and faults in memory above a region's break,
+ * so that the region can later grow into it without page faults.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -15,10 +44,17 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Dense heap memory is made accessible in steps of this many bytes */
+#define COMMIT_GRANULE (1UL << 20)
+
+/* Size of a transparent huge page */
+#define HUGE_PAGE_SIZE (1UL << 21)
+
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK {
     size_t id;                             /* Page ID.  Counts number of pages from start of heap */
@@ -26,11 +62,28 @@ typedef struct MBLK {
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* Data structure used to track the break of each heap region */
+typedef struct MREGION {
+    unsigned char *lo;                     /* First byte of region */
+    unsigned char *brk;                    /* Current position of region's break */
+    unsigned char *commit;                 /* End of accessible memory, in dense mode */
+    unsigned char *max;                    /* Maximum allowable region address */
+    bool active;                           /* Has the region been extended? */
+} mem_region_t;
+
 /* private global variables */
 static bool sparse = false;                 /* Use sparse memory emulation */
+static bool huge = false;                   /* Back the dense heap with huge pages */
+static size_t granule = COMMIT_GRANULE;     /* Unit of commits, trims and purges */
 static unsigned char *heap;                 /* Starting address of heap */
-static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static mem_region_t regions[MEM_MAX_REGIONS]; /* Region 0 is the main heap */
+static size_t region_span = 0;              /* Bytes in each secondary region */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards regions */
+static size_t heap_bytes = 0;               /* Bytes in all regions */
+static size_t peak_heap_bytes = 0;          /* Largest value of heap_bytes */
+static size_t sbrk_bytes = 0;               /* Bytes ever added to regions */
+static size_t map_bytes = 0;                /* Bytes in mappings made by mem_map */
 static size_t mmap_length = MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats = false;             /* Should program print allocation information? */
 static bool stats_printed = false;          /* Has information been printed about allocation */
@@ -48,13 +101,21 @@ static size_t num_buckets = 0;              /* Number of buckets in page table *
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr);
+static bool in_heap(const void *addr, size_t len);
+static bool commit_pages(mem_region_t *rp, unsigned char *new_brk);
+static void populate_pages(mem_region_t *rp, unsigned char *lo, unsigned char *hi);
+static void *region_sbrk(unsigned int region, intptr_t incr, bool quiet);
+static void release_pages(unsigned char *lo, unsigned char *hi);
 static void print_stats();
 
 /* 
- * mem_init - initialize the memory system model
+ * mem_init - initialize the memory system model.  do_huge asks for a dense
+ *		heap backed by transparent huge pages
  */
-void mem_init(bool do_sparse){
+void mem_init(bool do_sparse, bool do_huge){
     sparse = do_sparse;
+    huge = do_huge && !sparse;
+    granule = huge ? HUGE_PAGE_SIZE : COMMIT_GRANULE;
     if (sparse) {
 	/* Want sparse total allocation to approximately match the dense heap size */
 	/* Account for both page itself and its amortized contribution to the page table */
@@ -71,15 +132,17 @@ void mem_init(bool do_sparse){
 	num_pages = 0;
 	page_table = NULL;
 	num_buckets = 0;
-	mmap_length = MAX_DENSE_HEAP;
+	/* Room to align the heap to a huge page */
+	mmap_length = MAX_DENSE_HEAP + (huge ? HUGE_PAGE_SIZE : 0);
     }
 
+    /* The dense heap is only reserved here; see commit_pages */
     int dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
     void *addr = mmap(start,        /* suggested start*/
 		      mmap_length,  /* length */
-		      PROT_WRITE,   /* permissions */
-		      MAP_PRIVATE,  /* private or shared? */
+		      sparse ? PROT_WRITE : PROT_NONE, /* permissions */
+		      MAP_PRIVATE | MAP_NORESERVE, /* private or shared? */
 		      dev_zero,	    /* fd */
 		      0);	    /* offset */
     if (addr == MAP_FAILED) {
@@ -93,10 +156,23 @@ void mem_init(bool do_sparse){
 	mem_max_addr = heap + MAX_SPARSE_HEAP;
     } else {
 	heap = addr;
+	if (huge) {
+	    /* Unmap what lies outside the aligned heap */
+	    heap = (unsigned char *) (((uintptr_t) addr + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+	    if (heap > (unsigned char *) addr)
+		munmap(addr, heap - (unsigned char *) addr);
+	    if (heap < (unsigned char *) addr + HUGE_PAGE_SIZE)
+		munmap(heap + MAX_DENSE_HEAP, (unsigned char *) addr + HUGE_PAGE_SIZE - heap);
+	    mmap_length = MAX_DENSE_HEAP;
+	    madvise(heap, MAX_DENSE_HEAP, MADV_HUGEPAGE);
+	}
 	mem_max_addr = heap + MAX_DENSE_HEAP;
     }
+    /* Secondary regions split the upper half of the heap between them */
+    region_span = (mem_max_addr - heap) / (2 * (MEM_MAX_REGIONS - 1));
+    region_span -= region_span % (huge ? HUGE_PAGE_SIZE : mem_pagesize());
     stats_printed = false;
-    mem_brk = heap;
+    memset(regions, 0, sizeof(regions));
     mem_reset_brk();
 }
 
@@ -125,31 +201,99 @@ void mem_reset_brk(){
 	next_free_page = (mem_block_t *) ((unsigned char *) page_table + ptb);
 	num_free_pages = num_pages;
     }
-    mem_brk = heap;
+    pthread_mutex_lock(&mem_lock);
+    if (!sparse) {
+	/* Drop and decommit everything the regions committed */
+	for (unsigned int r = 0; r < MEM_MAX_REGIONS; r++) {
+	    if (regions[r].commit > regions[r].lo) {
+		size_t len = regions[r].commit - regions[r].lo;
+		madvise(regions[r].lo, len, MADV_DONTNEED);
+		mprotect(regions[r].lo, len, PROT_NONE);
+	    }
+	}
+    }
+    regions[0].lo = heap;
+    regions[0].max = mem_max_addr;
+    for (unsigned int r = 1; r < MEM_MAX_REGIONS; r++) {
+	regions[r].lo = mem_max_addr - r * region_span;
+	regions[r].max = regions[r].lo + region_span;
+    }
+    for (unsigned int r = 0; r < MEM_MAX_REGIONS; r++) {
+	regions[r].brk = regions[r].lo;
+	regions[r].commit = regions[r].lo;
+	regions[r].active = (r == 0);
+    }
+    heap_bytes = 0;
+    peak_heap_bytes = 0;
+    sbrk_bytes = 0;
+    pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
+ * mem_sbrk - simple model of the sbrk function. Extends the main heap 
  *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+ *		this model, the heap is shrunk with mem_region_trim instead.
  */
 void *mem_sbrk(intptr_t incr) {
-    unsigned char *old_brk = mem_brk;
+    return mem_region_sbrk(0, incr);
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for any region.  Activating a secondary
+ *		region fails if the main heap has already grown into it.
+ */
+void *mem_region_sbrk(unsigned int region, intptr_t incr) {
+    return region_sbrk(region, incr, false);
+}
+
+/*
+ * mem_region_try_sbrk - mem_region_sbrk without the error message, for
+ *		callers that handle the failure themselves
+ */
+void *mem_region_try_sbrk(unsigned int region, intptr_t incr) {
+    return region_sbrk(region, incr, true);
+}
+
+/* Extend a region's break by incr bytes, reporting failures on stderr
+ * unless quiet */
+static void *region_sbrk(unsigned int region, intptr_t incr, bool quiet) {
+    pthread_mutex_lock(&mem_lock);
+    mem_region_t *rp = &regions[region];
+    unsigned char *old_brk = rp->brk;
 
     bool ok = true;
     if (incr < 0) {
 	ok = false;
-	fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
-    } else if (mem_brk + incr > mem_max_addr) {
+	if (!quiet)
+	    fprintf(stderr, "ERROR: mem_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
+    } else if (!rp->active && regions[0].brk > rp->lo) {
+	ok = false;
+	if (!quiet)
+	    fprintf(stderr, "ERROR: mem_sbrk failed.  Region %u is already used by the main heap\n", region);
+    } else if (rp->brk + incr > rp->max) {
 	ok = false;
-	size_t alloc = mem_brk - heap + incr;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
-    } else if (!sparse && sbrk(incr) == (void*) -1) {
+	size_t alloc = rp->brk - rp->lo + incr;
+	if (!quiet)
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory.  Would require heap size of %zd (0x%zx) bytes\n", alloc, alloc);
+    } else if (!sparse && !commit_pages(rp, rp->brk + incr)) {
 	ok = false;
-	fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
+	if (!quiet)
+	    fprintf(stderr, "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
     if (ok) {
-	mem_brk += incr;
+	if (!rp->active) {
+	    rp->active = true;
+	    if (rp->lo < regions[0].max)
+		regions[0].max = rp->lo;
+	}
+	__atomic_store_n(&rp->brk, rp->brk + incr, __ATOMIC_RELEASE);
+	heap_bytes += incr;
+	sbrk_bytes += incr;
+	if (heap_bytes > peak_heap_bytes)
+	    peak_heap_bytes = heap_bytes;
+    }
+    pthread_mutex_unlock(&mem_lock);
+    if (ok) {
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -157,6 +301,61 @@ void *mem_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mem_region_trim - lower a region's break by decr bytes and give the
+ *		pages above the new break back to the system.  Returns false if
+ *		the region is smaller than decr
+ */
+bool mem_region_trim(unsigned int region, size_t decr) {
+    pthread_mutex_lock(&mem_lock);
+    mem_region_t *rp = &regions[region];
+    unsigned char *old_brk = rp->brk;
+
+    bool ok = true;
+    if (decr > (size_t) (rp->brk - rp->lo)) {
+	ok = false;
+	fprintf(stderr, "ERROR: mem_region_trim failed.  Attempt to shrink region %u below its start\n", region);
+    } else {
+	__atomic_store_n(&rp->brk, rp->brk - decr, __ATOMIC_RELEASE);
+	heap_bytes -= decr;
+	if (!sparse)
+	    release_pages(rp->brk, old_brk);
+    }
+    pthread_mutex_unlock(&mem_lock);
+    return ok;
+}
+
+/*
+ * mem_purge - give the whole pages inside [addr, addr+len) back to the
+ *		system.  The range stays in the heap and reads as zero
+ *		afterwards.  Nothing is released in sparse mode
+ */
+void mem_purge(void *addr, size_t len) {
+    if (!sparse)
+	release_pages((unsigned char *) addr, (unsigned char *) addr + len);
+}
+
+/*
+ * mem_region_prefault - commit the len bytes above a region's break, or up
+ *		to the region's end, and fault them in for writing.  The faults
+ *		are taken without holding the memory system's lock.  Returns
+ *		false if the memory cannot be committed.  Nothing is done in
+ *		sparse mode
+ */
+bool mem_region_prefault(unsigned int region, size_t len) {
+    if (sparse)
+	return true;
+    pthread_mutex_lock(&mem_lock);
+    mem_region_t *rp = &regions[region];
+    unsigned char *lo = rp->brk;
+    unsigned char *hi = (len < (size_t) (rp->max - lo)) ? lo + len : rp->max;
+    bool ok = commit_pages(rp, hi);
+    pthread_mutex_unlock(&mem_lock);
+    if (ok)
+	populate_pages(rp, lo, hi);
+    return ok;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -165,17 +364,76 @@ void *mem_heap_lo(){
 }
 
 /* 
- * mem_heap_hi - return address of last heap byte
+ * mem_heap_hi - return address of last byte of the main heap
  */
 void *mem_heap_hi(){
-    return (void *)(mem_brk - 1);
+    return (void *)(regions[0].brk - 1);
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heapsize() - returns the heap size in bytes, summed over all regions
  */
 size_t mem_heapsize() {
-    return (size_t)(mem_brk - heap);
+    size_t size = 0;
+    for (unsigned int r = 0; r < MEM_MAX_REGIONS; r++)
+	size += (size_t)(regions[r].brk - regions[r].lo);
+    return size;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size so far, in bytes
+ */
+size_t mem_peak_heapsize() {
+    pthread_mutex_lock(&mem_lock);
+    size_t size = peak_heap_bytes;
+    pthread_mutex_unlock(&mem_lock);
+    return size;
+}
+
+/*
+ * mem_sbrk_total() - returns the number of bytes ever added to the heap
+ */
+size_t mem_sbrk_total() {
+    pthread_mutex_lock(&mem_lock);
+    size_t size = sbrk_bytes;
+    pthread_mutex_unlock(&mem_lock);
+    return size;
+}
+
+/*
+ * mem_mapsize() - returns the number of bytes in mappings from mem_map
+ */
+size_t mem_mapsize() {
+    return __atomic_load_n(&map_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_region_lo - return address of the first byte of a region
+ */
+void *mem_region_lo(unsigned int region) {
+    return (void *) regions[region].lo;
+}
+
+/*
+ * mem_region_hi - return address of the last byte of a region
+ */
+void *mem_region_hi(unsigned int region) {
+    return (void *)(regions[region].brk - 1);
+}
+
+/*
+ * mem_region_of - return the region holding a heap address, or
+ *		MEM_MAX_REGIONS if the address is outside the heap.  Anything
+ *		below the main break belongs to the main heap, since no
+ *		secondary region is activated below it.
+ */
+unsigned int mem_region_of(const void *addr) {
+    const unsigned char *a = (const unsigned char *) addr;
+    if (a < heap || a >= mem_max_addr)
+	return MEM_MAX_REGIONS;
+    if (a < __atomic_load_n(&regions[0].brk, __ATOMIC_ACQUIRE))
+	return 0;
+    return (unsigned int) ((mem_max_addr - a - 1) / region_span) + 1;
 }
 
 /*
@@ -185,6 +443,58 @@ size_t mem_pagesize(){
     return (size_t) getpagesize();
 }
 
+/*
+ * mem_map - map len bytes of zeroed memory outside the heap.  Returns
+ *		NULL on failure
+ */
+void *mem_map(size_t len) {
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+	return NULL;
+    __atomic_add_fetch(&map_bytes, len, __ATOMIC_RELAXED);
+    return addr;
+}
+
+/*
+ * mem_remap - resize a mapping made by mem_map, moving it if needed.
+ *		Returns its new address, or NULL on failure, in which case the
+ *		old mapping is left untouched
+ */
+void *mem_remap(void *addr, size_t old_len, size_t new_len) {
+    void *naddr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    if (naddr == MAP_FAILED)
+	return NULL;
+    __atomic_add_fetch(&map_bytes, new_len - old_len, __ATOMIC_RELAXED);
+    return naddr;
+}
+
+/*
+ * mem_unmap - give a mapping made by mem_map back to the system
+ */
+void mem_unmap(void *addr, size_t len) {
+    munmap(addr, len);
+    __atomic_sub_fetch(&map_bytes, len, __ATOMIC_RELAXED);
+}
+
+/*
+ * mem_map_meta - map len bytes of zeroed memory outside the heap for the
+ *		allocator's own bookkeeping.  Unlike mem_map, it is not counted
+ *		by mem_mapsize.  Returns NULL on failure
+ */
+void *mem_map_meta(size_t len) {
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (addr == MAP_FAILED) ? NULL : addr;
+}
+
+/*
+ * mem_unmap_meta - give a mapping made by mem_map_meta back to the system
+ */
+void mem_unmap_meta(void *addr, size_t len) {
+    munmap(addr, len);
+}
+
 /*************** Memory emulation  *******************/
 
 __int128 mem_read128(const void* addr)
@@ -204,8 +514,7 @@ void mem_write128(void* addr, __int128 val)
 /* Read len bytes and return value zero-extended to 64 bits */
 uint64_t mem_read(const void *addr, size_t len) {
     uint64_t rdata;
-    if (sparse &&
-	(unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && in_heap(addr, len)) {
 	/* Heap read.  Check if it crosses page boundary */
 	size_t id = page_id(addr);
 	void *paddr = get_mem(addr);
@@ -237,8 +546,7 @@ uint64_t mem_read(const void *addr, size_t len) {
 
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len) {
-    if (sparse &&
-	(unsigned char *) addr >= heap && (unsigned char *) addr+len <= mem_brk) {
+    if (sparse && in_heap(addr, len)) {
 	/* Heap write.  Check to see if it crosses page boundary */
 	size_t id = page_id(addr);
 	void *paddr = get_mem(addr);
@@ -319,14 +627,80 @@ static void print_stats() {
 	size_t ppages = num_pages - num_free_pages;
 	size_t pbytes = ppages * SPARSE_PAGE_SIZE;
 	printf("Allocated %zu/%zu pages (%zu bytes) to cover %zu heap bytes (%.4f%% density).  Max address = %p\n",
-	       ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes, mem_brk);
+	       ppages, num_pages, pbytes, vbytes, 100.0 * pbytes / vbytes, regions[0].brk);
     } else {
 	printf("Allocated %zu heap bytes.  Max address = %p\n",
-	       vbytes, mem_brk);
+	       vbytes, regions[0].brk);
     }
     stats_printed = true;
 }
 
+/* Is [addr, addr+len) inside the used part of some region? */
+static bool in_heap(const void *addr, size_t len) {
+    const unsigned char *a = (const unsigned char *) addr;
+    unsigned int region = mem_region_of(addr);
+    if (region == MEM_MAX_REGIONS)
+	return false;
+    mem_region_t *rp = &regions[region];
+    return a >= rp->lo && a + len <= rp->brk;
+}
+
+/* Drop the whole pages between lo and hi; whole huge pages with huge */
+static void release_pages(unsigned char *lo, unsigned char *hi) {
+    size_t page = huge ? HUGE_PAGE_SIZE : mem_pagesize();
+    uintptr_t start = ((uintptr_t) lo + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t) hi & ~(page - 1);
+    if (start < end)
+	madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/* Make a region accessible up to new_brk, committing whole granules past
+ * it at once.  Requires mem_lock */
+static bool commit_pages(mem_region_t *rp, unsigned char *new_brk) {
+    if (new_brk <= rp->commit)
+	return true;
+    uintptr_t end = ((uintptr_t) new_brk + granule - 1) & ~(granule - 1);
+    if (end > (uintptr_t) rp->max)
+	end = (uintptr_t) rp->max;
+    if (mprotect(rp->commit, end - (uintptr_t) rp->commit, PROT_READ | PROT_WRITE) != 0)
+	return false;
+    rp->commit = (unsigned char *) end;
+    return true;
+}
+
+/* Fault in the pages of a region between lo and hi for writing, leaving
+ * their contents alone.  Without MADV_POPULATE_WRITE, each page gets an
+ * atomic add of zero, which cannot lose a concurrent write to the heap.
+ * Those adds are made a granule at a time under mem_lock, and stop at the
+ * region's committed end, so that mem_reset_brk cannot decommit the pages
+ * while they are touched */
+static void populate_pages(mem_region_t *rp, unsigned char *lo, unsigned char *hi) {
+    size_t page = mem_pagesize();
+    uintptr_t start = (uintptr_t) lo & ~(page - 1);
+    if (start >= (uintptr_t) hi)
+	return;
+#ifdef MADV_POPULATE_WRITE
+    /* Only fall back when the kernel does not know the advice */
+    if (madvise((void *) start, (uintptr_t) hi - start, MADV_POPULATE_WRITE) == 0 ||
+	errno != EINVAL)
+	return;
+#endif
+    bool last = false;
+    for (uintptr_t p = start; !last && p < (uintptr_t) hi; ) {
+	pthread_mutex_lock(&mem_lock);
+	uintptr_t end = p + granule;
+	if (end > (uintptr_t) hi)
+	    end = (uintptr_t) hi;
+	if (end >= (uintptr_t) rp->commit) {
+	    end = (uintptr_t) rp->commit;
+	    last = true;
+	}
+	for (; p < end; p += page)
+	    __atomic_fetch_add((unsigned char *) p, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&mem_lock);
+    }
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr) {
     size_t offset = (unsigned char *) addr - (unsigned char *) SPARSE_HEAP_START;
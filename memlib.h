@@ -2,7 +2,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void mem_init(bool sparse);               
+/* Number of independently growing heap regions.  Region 0 is the main heap */
+#define MEM_MAX_REGIONS 16
+
+void mem_init(bool sparse, bool huge);
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
@@ -11,6 +14,34 @@ void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
 
+/* Per-region versions of the above */
+void *mem_region_sbrk(unsigned int region, intptr_t incr);
+void *mem_region_try_sbrk(unsigned int region, intptr_t incr);
+void *mem_region_lo(unsigned int region);
+void *mem_region_hi(unsigned int region);
+unsigned int mem_region_of(const void *addr);
+
+/* Giving memory back to the system */
+bool mem_region_trim(unsigned int region, size_t decr);
+void mem_purge(void *addr, size_t len);
+
+/* Faulting in memory ahead of a region's break */
+bool mem_region_prefault(unsigned int region, size_t len);
+
+/* Mappings outside the heap, for very large blocks */
+void *mem_map(size_t len);
+void *mem_remap(void *addr, size_t old_len, size_t new_len);
+void mem_unmap(void *addr, size_t len);
+
+/* Mappings for the allocator's own bookkeeping, left out of mem_mapsize */
+void *mem_map_meta(size_t len);
+void mem_unmap_meta(void *addr, size_t len);
+
+/* Heap and mapping usage, for statistics */
+size_t mem_peak_heapsize(void);
+size_t mem_sbrk_total(void);
+size_t mem_mapsize(void);
+
 /* Functions used for memory emulation */
 
 /* Read len bytes and return value zero-extended to 64 bits */
@@ -42,12 +42,26 @@
  *  PAYLOAD: Memory allocated for program to store information.               
  *  The size of an allocated block is exactly PAYLOAD + HEADER.      
  *                                                                            
+ *  Requests of mmap_threshold bytes or more are not placed on the heap.     
+ *  Each gets a mapping of its own, rounded up to whole pages, whose first   
+ *  word is padding and whose second is the HEADER. Such a header has the    
+ *  third lowest order bit set, and its size is the size of the mapping.     
+ *  free unmaps the block at once, and realloc resizes the mapping with      
+ *  mremap instead of copying the payload.                                   
+ *                                                                            
+ *  The fourth lowest order bit of an allocated block's header is set while  
+ *  the heap profiler holds a sample of it. Updates to a neighbour's         
+ *  previous-allocated bit go through set_alloc_prev, which keeps it.        
+ *                                                                            
  *  Free blocks contain the following:                                        
  *  HEADER, as defined above.                                                 
  *  FOOTER, as defined above.
  *  PREV_POINTER, that points to the previous free block in its segregated list
  *  NEXT_POINTER, that points to the next free block in its segregated list                                                 
  *  The size of an unallocated block is at least 32 bytes.                    
+ *  Free blocks of tree_min_size bytes or more are kept in red-black trees    
+ *  instead of lists (see BLOCK ALLOCATION), and hold tree links instead:    
+ *  LEFT, RIGHT and PARENT pointers and a RED flag.                          
  *                                                                            
  *  Block Visualization.                                                      
  *                    block     block+8          block+size    
@@ -56,6 +70,9 @@
  *                    block     block+8          block+16       block+24     block+size-8  block+size 
  *  Unallocated blocks: |  HEADER  |  PREV_POINTER  | NEXT_POINTER |  ...EMPTY...  |  FOOTER  |           
  *                                                                            
+ *                    block     block+8   block+16  block+24  block+32 block+size-8  block+size 
+ *  Tree blocks:        |  HEADER  |  LEFT  |  RIGHT  |  PARENT  |  RED  |  ...  |  FOOTER  |           
+ *                                                                            
  *  ************************************************************************  
  *  ** INITIALIZATION. **                                                     
  *                                                                            
@@ -77,18 +94,248 @@
  *  block that can fit the content based on a first-fit search policy.                        
  *  The search starts by determing which segregated list to look in, based on 
  *  the requested size.
+ *  Lists are log-linear size classes: every power of two [2^k, 2^(k+1)) is
+ *  split into SEG_SUBCLASSES equal classes, from min_block_size up to 2^31.
+ *  Larger blocks all share the last list. The class of a size comes
+ *  straight from its leading-zero count, see get_seglist_size.
  *  After this, the selected list is iterated until:                                    
  *  - A sufficiently-large unallocated block is found, or                     
  *  - The end of the segregated free list is reached, which occurs              
  *    when no sufficiently-large unallocated block is available.
- *    The search then carries on until the next list, which repeats
- *    until all the lists have been exhausted. This means no appropriate
- *    free block was found.              
+ *    Every block in a later list is large enough, so the search then
+ *    takes the first block of the next non-empty list. That list is found
+ *    with a find-first-set on binmap, a bitmap with bit i set whenever
+ *    seglist[i] is non-empty, kept current by insert_list and remove_list.
+ *    If there is none, no appropriate free block was found.              
+ *  Lists for blocks of tree_min_size bytes and up are not linked lists but  
+ *  red-black trees ordered by (size, address), stored in the free blocks.   
+ *  Within such a list the search is best-fit in O(log n), and a later       
+ *  tree's smallest block is taken, so large blocks are always best-fit.     
  *  In case that a sufficiently-large unallocated block is found, then        
  *  that block will be used for allocation. Otherwise--that is, when no       
  *  sufficiently-large unallocated block is found--then more unallocated      
- *  memory of size chunksize or requested size, whichever is larger, is       
- *  requested through mem_sbrk, and the search is redone.                     
+ *  memory of the arena's growth step or requested size, whichever is        
+ *  larger, is requested through mem_sbrk, and the search is redone.         
+ *                                                                            
+ *  The growth step (see grow_size) starts at chunksize and doubles when an  
+ *  arena's heap is extended again within GROW_WINDOW_MS of the previous     
+ *  extension, up to grow_max. It halves after a quieter period and when    
+ *  the heap is trimmed. If an extension by the step fails, the heap is     
+ *  extended by max(chunksize, requested size) instead, and the step starts 
+ *  over at chunksize. memlib only reports failures that have no fallback:  
+ *  not that first one, nor those of secondary arenas, of growing a block   
+ *  in place, or of a full slab region. The driver measures time in         
+ *  allocations from the arena (GROW_WINDOW_TICKS), so its runs repeat.     
+ *                                                                            
+ *  Requests for an alignment A above 16 bytes (memalign, posix_memalign,    
+ *  aligned_alloc) take a block of S + A + min_block_size bytes in the same  
+ *  way. The leading part before the first A-aligned payload with room for   
+ *  a free block is split off and freed, and so is the tail beyond S, so     
+ *  the block left allocated is no larger than an unaligned one. Such       
+ *  requests always come from the heap, never from slabs or mappings.       
+ *                                                                            
+ *  ************************************************************************  
+ *  ** RELEASING MEMORY. **                                                  
+ *                                                                            
+ *  When a block is freed and coalesced (see free_block), the result is      
+ *  checked against two thresholds:                                          
+ *  - A free block of at least trim_threshold bytes at the end of its heap   
+ *    is cut down to a pad of the growth step (at least chunksize), and the  
+ *    heap's break is lowered by the rest, so that the next extensions do   
+ *    not have to take the memory back at once.                             
+ *  - Then a free block of at least purge_threshold bytes, including such  
+ *    a pad, has the whole pages between its links and its footer purged,  
+ *    so they no longer count towards the process's memory until reused.   
+ *    Neighbours that were purged when they were freed are not purged       
+ *    again; only the pages of the freed block and of smaller neighbours    
+ *    are. A large free block is taken to be purged unless it is on the     
+ *    dirty list (see get_purged), so none may be left resident otherwise. 
+ *  Setting a threshold to SIZE_MAX turns that mechanism off.                
+ *                                                                            
+ *  Purging on free adds system calls to free. With a non-zero purge_decay,  
+ *  such blocks are instead stamped with the time and put on their arena's   
+ *  dirty list, newest first. Every PURGE_TICK allocations from an arena,    
+ *  up to PURGE_BATCH of its blocks that have been free for purge_decay     
+ *  milliseconds are purged, oldest first. A dirty block that is split by    
+ *  place leaves a dirty remainder, stamped anew, and so does one that      
+ *  extend_heap merges with the new space. Tree blocks hold the dirty list  
+ *  links and stamp after their tree links.                                 
+ *                                                                            
+ *  With MM_OPT_HUGE_PAGES, memlib backs the heap with transparent huge      
+ *  pages and commits, trims and purges it in whole huge pages, so the       
+ *  thresholds above only take effect on 2 MiB boundaries.                  
+ *                                                                            
+ *  ************************************************************************  
+ *  ** PREFAULTING. **                                                       
+ *                                                                            
+ *  The first touch of a page that extend_heap adds takes a page fault on    
+ *  the allocation path. Two options move those faults elsewhere:            
+ *  - prefault_size: when an arena's heap is made (arena 0's by mm_init),   
+ *    that many bytes past its break are faulted in at once.                 
+ *  - prefault_ahead: a background thread, prefault_run, keeps that many     
+ *    bytes past the break of each growing arena faulted in. extend_heap     
+ *    wakes it when the break comes within half of that distance of the     
+ *    memory already faulted in, so most extensions do not wake it.         
+ *  Faulted-in memory counts towards the process's memory, not the heap's.   
+ *                                                                            
+ *  ************************************************************************  
+ *  ** SLABS. **                                                             
+ *                                                                            
+ *  Requests of up to slab_max_size bytes are not placed on the heap but in  
+ *  slabs: SLAB_RUN_SIZE-byte runs of equal objects of 16, 32, 48 or 64      
+ *  bytes, with no header, footer or coalescing. All runs are carved from    
+ *  one heap region, SLAB_REGION, so an address in that region is a slab     
+ *  object, and the run holding it starts at the address rounded down to     
+ *  SLAB_RUN_SIZE. Each run starts with a slab_run_t header that records     
+ *  its object size, its owning arena and a bitmap of objects in use.        
+ *  An arena keeps the runs of each size with free objects on a list. A run  
+ *  that becomes empty is put on the shared list of unused runs, unless it   
+ *  is the only run of its size with free objects.                          
+ *                                                                            
+ *  ************************************************************************  
+ *  ** BATCHES. **                                                           
+ *                                                                            
+ *  mm_malloc_batch allocates n blocks of one size with a single lock        
+ *  acquisition. Slab sizes take n objects from the runs. Larger sizes       
+ *  find or make one free block of n times the block size, place it once,   
+ *  and cut it into n blocks by writing their headers.                      
+ *  mm_free_batch sorts the pointers by address. Runs of pointers to        
+ *  blocks that follow each other on the heap are merged into one block     
+ *  before being freed, so each run is coalesced and listed only once.      
+ *  Blocks of other arenas are pushed onto their remote queues.             
+ *                                                                            
+ *  ************************************************************************  
+ *  ** SCOPED REGIONS. **                                                    
+ *                                                                            
+ *  A scoped region (mm_region_t, unrelated to memlib's heap regions) holds  
+ *  objects that die together. It owns a list of chunks, blocks taken from   
+ *  the heap by meta_alloc with a region_chunk_t header. mm_region_alloc     
+ *  bumps a pointer through the current chunk and moves to the next one when 
+ *  it is full, adding a chunk of REGION_CHUNK_SIZE bytes (or of the request,
+ *  if larger) when there is none. mm_region_reset moves the pointer back to 
+ *  the first chunk and keeps every chunk, so it is O(1) and never touches   
+ *  the segregated lists. mm_region_destroy frees the chunks. A region is not
+ *  thread-safe.                                                             
+ *                                                                            
+ *  ************************************************************************  
+ *  ** OBJECT POOLS. **                                                      
+ *                                                                            
+ *  A pool (mm_pool_t) hands out objects of one size and alignment from      
+ *  chunks of chunk_size bytes, a power of two of at least POOL_CHUNK_SIZE   
+ *  that holds POOL_MIN_OBJS objects. Chunks are taken from the heap by      
+ *  meta_alloc, aligned to their size, so an object finds its chunk's        
+ *  pool_chunk_t header by rounding down. A chunk hands out never-used       
+ *  objects by bumping a pointer, and freed ones from a free list linked     
+ *  through their first word, so alloc and free are a pop and a push. Chunks 
+ *  with room are kept at the front of the pool's list. An empty chunk is    
+ *  given back to the heap unless no other chunk has room. A pool is not     
+ *  thread-safe.                                                             
+ *                                                                            
+ *  ************************************************************************  
+ *  ** STATISTICS. **                                                        
+ *                                                                            
+ *  mm_get_stats reports call counts, live bytes, heap and mapping sizes and 
+ *  the free space on each segregated list. Each thread counts its own calls 
+ *  and the usable bytes it allocates and frees in a thread_stats_t, without 
+ *  locks or atomic read-modify-writes; the counters of all threads are      
+ *  linked into stats_threads and summed when stats are read. When a thread  
+ *  exits, its counters are added to stats_retired. Live bytes are kept      
+ *  modulo 2^64, since a thread may free more than it allocated. Free space  
+ *  is found by walking the lists, and heap sizes are kept by memlib. Memory 
+ *  the allocator takes for itself, for regions, pools and the heap profiler,
+ *  comes from meta_alloc and is not counted as calls or live bytes, only in 
+ *  the heap size, so that turning on profiling does not change the counts.  
+ *                                                                            
+ *  ************************************************************************  
+ *  ** HEAP PROFILING. **                                                    
+ *                                                                            
+ *  With MM_OPT_PROF_RATE set to R, malloc samples about one allocation per  
+ *  R bytes. Each thread counts down the bytes it allocates from a distance  
+ *  drawn from an exponential distribution of mean R (see prof_next), so     
+ *  the sampled bytes form a Poisson process and large blocks are more      
+ *  likely to be sampled. A sampled request skips the slabs and the tcache  
+ *  so that its block has a header, whose sampled bit is set. Its stack is  
+ *  captured with backtrace and kept in prof_table, a hash table keyed by   
+ *  payload address whose entries come from an object pool. free checks    
+ *  the bit and drops the sample. realloc always moves a sampled block.     
+ *  mm_prof_dump writes the live samples in the text format of pprof's     
+ *  heap profiles (heap_v2), followed by the process's mappings for         
+ *  symbolization. Samples are merged by stack in linear time, by chaining  
+ *  them into prof_stacks, a second hash table keyed by stack. The profiler 
+ *  never samples itself, nor allocations made while backtrace runs.        
+ *                                                                            
+ *  ************************************************************************  
+ *  ** TRACE RECORDING. **                                                   
+ *                                                                            
+ *  Between mm_trace_start(fd) and mm_trace_stop, every call to malloc,      
+ *  calloc, realloc, free and the other public allocation functions is       
+ *  recorded as mm_trace_event_t records (see mm.h): the operation, size,    
+ *  block address as its id, thread number and a timestamp. realloc gives two
+ *  consecutive events, for the old block and the new one. Events go into a  
+ *  ring of TRACE_RING_EVENTS per thread, without locks; a full ring drops   
+ *  the event rather than wait. The rings are mapped outside the heap with   
+ *  mem_map_meta, so recording leaves the heap and the statistics as they    
+ *  would be without it. A writer thread drains the rings to fd every        
+ *  TRACE_FLUSH_US microseconds. The file is not ordered across threads; sort
+ *  by timestamp to replay it. Calls the allocator makes to itself while     
+ *  handling a recorded call are not recorded.                               
+ *                                                                            
+ *  ************************************************************************  
+ *  ** ARENAS. **                                                            
+ *                                                                            
+ *  There are up to MAX_ARENAS independent heaps (arenas). Arena i owns heap 
+ *  region i of memlib, and has its own prologue, epilogue, segregated lists 
+ *  and lock. Arena 0 is the main heap. Threads are assigned to arenas       
+ *  round-robin on their first allocation. A block is always returned to the 
+ *  arena it came from, which is found from its address through              
+ *  mem_region_of. When a secondary arena runs out of room, allocations fall 
+ *  back to the main heap.                                                   
+ *                                                                            
+ *  ************************************************************************  
+ *  ** THREAD CACHES. **                                                     
+ *                                                                            
+ *  The segregated lists and slabs of an arena are protected by its lock.    
+ *  In front of them, each thread keeps a small                              
+ *  cache (tcache) with one bin per 16-byte size class up to               
+ *  tcache_max_size. The bins for sizes up to slab_max_size hold slab       
+ *  objects, and the others hold heap blocks of that size. A cached block    
+ *  keeps its allocated header, so it is never coalesced, and is linked into 
+ *  its bin through the first word of its payload.                           
+ *  - malloc pops from the thread's bin. An empty bin is refilled with       
+ *    TCACHE_BATCH blocks or slab objects from the thread's arena under a    
+ *    single lock acquisition.                                               
+ *  - free pushes onto the thread's bin. A full bin first flushes            
+ *    TCACHE_BATCH blocks back to the segregated lists of their arenas.      
+ *    free_sized picks the bin of a heap block from the size the caller     
+ *    allocated instead of the block's header. That bin's size is the      
+ *    block's, or 16 bytes less, as for blocks of a refill; either way the  
+ *    block fits the bin. A slab object's bin is its run's size, since a    
+ *    realloc that shrinks it leaves it in place.                           
+ *    Mapped blocks must not be cached, so it checks the header's mapped    
+ *    bit when size is at least the lowest mmap_threshold ever set.         
+ *  Blocks still cached when a thread exits are returned to the heap by the  
+ *  destructor of tcache_key.                                                
+ *                                                                            
+ *  ************************************************************************  
+ *  ** REMOTE FREES. **                                                      
+ *                                                                            
+ *  free, realloc and the thread caches never take the lock of another arena.
+ *  Each arena has a lock-free queue of remote frees: a stack of blocks,     
+ *  linked through aof.fb.next, that other threads push onto with a single   
+ *  compare-and-swap. Blocks in it keep their allocated headers, so they are 
+ *  not coalesced. The queue is drained, all at once, by the next allocation 
+ *  from the arena under its lock, before find_fit or slab_take, and by      
+ *  mm_get_stats.                                                            
+ *  - free pushes large blocks of other arenas directly.                     
+ *  - tcache_flush and mm_free_batch free blocks of the thread's own arena   
+ *    under its lock, and push runs of consecutive blocks of another arena   
+ *    as one chain.                                                          
+ *  - realloc resizes only blocks of the thread's own arena in place. A     
+ *    block of another arena is kept as it is if it is large enough and at   
+ *    most twice the size needed, and is otherwise moved, the old block      
+ *    being freed remotely.                                                  
+ *  A thread that has never allocated has no arena, so all of its frees are  
+ *  remote. Blocks stay queued while nobody allocates from their arena.      
  *                                                                            
  */
 
@@ -110,12 +357,25 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define free_sized mm_free_sized
+#define malloc_usable_size mm_malloc_usable_size
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
 
 /* You can change anything from here onward */
 
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <time.h>
+
 /*
  * If DEBUG is defined, enable printing on dbg_printf and contracts.
  * Debugging macros, with names beginning "dbg_" are allowed.
@@ -146,15 +406,66 @@ static const size_t chunksize = (1 << 12);    // requires (chunksize % 16 == 0)
 
 #define ALIGNMENT 16
 #define BLOCK_SIZE sizeof(block_t)
-#define SEG_SIZE   8      // Number of segregated lists
-#define SIZE_LIST1 32     // Max block size that seglist[SIZE_LIST(n-1)] holds
-#define SIZE_LIST2 64 
-#define SIZE_LIST3 128 
-#define SIZE_LIST4 256 
-#define SIZE_LIST5 512 
-#define SIZE_LIST6 1024 
-#define SIZE_LIST7 2048
-#define SIZE_LIST8 4096
+#define SEG_SUBCLASS_BITS 2  // log2 of the number of lists per power of two
+#define SEG_SUBCLASSES (1 << SEG_SUBCLASS_BITS)
+#define SEG_MIN_LOG2   5     // log2(min_block_size), first class
+#define SEG_MAX_LOG2   31    // Blocks of 2^SEG_MAX_LOG2 and up share one list
+#define SEG_SIZE       ((SEG_MAX_LOG2 - SEG_MIN_LOG2) * SEG_SUBCLASSES) // Number of segregated lists
+#define TREE_MIN_LOG2  11    // Lists from 2^TREE_MIN_LOG2 bytes up are trees
+#define TREE_FIRST_LIST ((TREE_MIN_LOG2 - SEG_MIN_LOG2) * SEG_SUBCLASSES)
+#define BINMAP_BITS  64   // Bits per binmap word
+#define BINMAP_WORDS ((SEG_SIZE + BINMAP_BITS - 1) / BINMAP_BITS)
+_Static_assert(SEG_SIZE == MM_STATS_LISTS, "mm_stats_t needs an entry per list");
+
+/* Scoped region constants */
+#define REGION_CHUNK_SIZE (1 << 16) // Usable bytes in a standard region chunk
+
+/* Object pool constants */
+#define POOL_CHUNK_SIZE (1 << 16) // Minimum size and alignment of a pool chunk
+#define POOL_MIN_OBJS   8         // Minimum number of objects per chunk
+
+/* Heap profiler constants */
+#define PROF_MAX_DEPTH 32    // Frames kept per sampled stack
+#define PROF_SKIP      1     // Frames of the profiler itself
+#define PROF_BUCKETS   4096  // Buckets of prof_table, a power of two
+
+/* Trace recorder constants */
+#define TRACE_RING_EVENTS (1 << 16) // Events per thread ring, a power of two
+#define TRACE_FLUSH_US    1000      // Writer thread period (microseconds)
+
+/* Slab constants */
+#define SLAB_CLASSES  4                      // Object sizes 16, 32, 48 and 64
+#define SLAB_RUN_SIZE 4096                   // Size and alignment of a run
+#define SLAB_REGION   (MEM_MAX_REGIONS - 1)  // Heap region holding every run
+#define SLAB_MAP_WORDS (SLAB_RUN_SIZE / ALIGNMENT / BINMAP_BITS)
+static const size_t slab_max_size = SLAB_CLASSES*ALIGNMENT; // Largest slab object
+
+/* Arena constants */
+#define MAX_ARENAS SLAB_REGION // One arena per remaining heap region
+
+/* Thread cache constants */
+#define TCACHE_BINS  32  // Number of tcache bins, one per 16-byte size class
+#define TCACHE_COUNT 16  // Max number of blocks held by one tcache bin
+#define TCACHE_BATCH 8   // Blocks moved per refill from/flush to the seglists
+static const size_t tcache_max_size = TCACHE_BINS*ALIGNMENT; // Largest cached block
+
+/* Direct mapping constants */
+#ifdef DRIVER
+#define MMAP_THRESHOLD SIZE_MAX  // Keep every block in the heap for the driver
+#else
+#define MMAP_THRESHOLD (1 << 20) // Default mmap_threshold
+#endif
+
+/* Heap growth constants */
+#define GROW_MAX (1 << 20)        // Default grow_max
+#define GROW_WINDOW_MS 100        // Extensions closer than this grow the step
+#define GROW_WINDOW_TICKS 256     // The same in allocations, for the driver
+
+/* Memory release constants */
+#define TRIM_THRESHOLD  (1 << 17) // Default trim_threshold
+#define PURGE_THRESHOLD (1 << 16) // Default purge_threshold
+#define PURGE_TICK  64            // Allocations between dirty list sweeps
+#define PURGE_BATCH 16            // Max blocks purged per sweep
 
 /* Basic structures */
 typedef struct free_block {
@@ -165,6 +476,20 @@ typedef struct free_block {
     struct block *prev;
 } free_t;
 
+typedef struct tree_node {
+/*
+ * Red-black tree node, used instead of free_t by blocks in tree lists.
+ */
+    struct block *left;
+    struct block *right;
+    struct block *parent;
+    word_t red;
+    /* Dirty list for decay purging, newest first */
+    struct block *dirty_next;  // Next older dirty block
+    struct block *dirty_prev;  // Next newer dirty block
+    word_t dirty_since;        // When the block was dirtied (ms), 0 if clean
+} tree_t;
+
 typedef struct block {
 /* 
  * Block type structure.
@@ -180,6 +505,7 @@ typedef struct block {
      */ 
     union alloc_or_free {
         struct free_block fb;
+        struct tree_node tn;
         /*
          * We don't know how big the payload will be. Declaring it as an
          * array of size 0 allows computing its starting address using
@@ -194,17 +520,234 @@ typedef struct block {
      */
 } block_t;
 
+typedef struct slab_run {
+/*
+ * Header at the start of each slab run, followed by its objects.
+ */
+    struct slab_run *next;        // Next run in its arena's or the unused list
+    struct slab_run *prev;        // Previous run in its arena's list
+    unsigned int arena;           // Owning arena
+    unsigned int size;            // Object size, 0 while the run is unused
+    unsigned int nfree;           // Number of free objects
+    unsigned int nobjs;           // Number of objects
+    word_t map[SLAB_MAP_WORDS];   // Bit i set when object i is in use
+} slab_run_t;
+
+typedef struct region_chunk {
+/*
+ * Header of a block of a scoped region, followed by its bump space.
+ */
+    struct region_chunk *next;    // Next chunk of the region
+    size_t size;                  // Bytes of bump space
+} region_chunk_t;
+
+struct mm_region {
+/*
+ * Scoped region: bump allocation through a list of chunks.
+ */
+    region_chunk_t *head;         // First chunk
+    region_chunk_t *chunk;        // Chunk being bumped, NULL before any
+    char *cur;                    // Next free byte of chunk
+    char *end;                    // End of chunk
+};
+
+typedef struct pool_chunk {
+/*
+ * Header at the start of each chunk of an object pool, followed by its
+ * objects.
+ */
+    struct pool_chunk *next;      // Next chunk of the pool
+    struct pool_chunk *prev;      // Previous chunk of the pool
+    void *free;                   // Freed objects, linked through their first word
+    char *bump;                   // First object never handed out
+    size_t live;                  // Number of objects in use
+} pool_chunk_t;
+
+struct mm_pool {
+/*
+ * Pool of objects of one size. Chunks with room come first in its list.
+ */
+    size_t stride;                // Distance between objects
+    size_t first;                 // Offset of the first object in a chunk
+    size_t chunk_size;            // Size and alignment of chunks
+    pool_chunk_t *head;           // First chunk
+    pool_chunk_t *tail;           // Last chunk
+};
+
+typedef struct thread_stats {
+/*
+ * Statistics counters of one thread, linked into stats_threads. Only
+ * their thread writes them.
+ */
+    struct thread_stats *next;
+    struct thread_stats *prev;
+    size_t mallocs;               // Blocks allocated
+    size_t frees;                 // Blocks freed
+    size_t reallocs;              // Calls to realloc
+    size_t live;                  // Usable bytes allocated minus freed, modulo 2^64
+} thread_stats_t;
+
+typedef struct prof_sample {
+/*
+ * A live sampled block, in its prof_table bucket.
+ */
+    struct prof_sample *next;     // Next sample in the bucket
+    void *ptr;                    // Payload of the block
+    size_t size;                  // Requested size
+    struct prof_sample *same;     // Next sample in its prof_stacks bucket
+    int depth;                    // Frames in stack
+    void *stack[PROF_MAX_DEPTH];  // Return addresses, innermost first
+} prof_sample_t;
+
+typedef struct prof_out {
+/*
+ * Buffered output of mm_prof_dump, written with write(2) so that dumping
+ * does not allocate.
+ */
+    int fd;
+    bool ok;                      // No write has failed
+    size_t len;                   // Bytes in buf
+    char buf[4096];
+} prof_out_t;
+
+typedef struct trace_ring {
+/*
+ * Single-producer single-consumer ring of trace events. Its thread only
+ * writes head, and the writer thread only writes tail.
+ */
+    struct trace_ring *next;      // Next ring in trace_rings
+    bool owned;                   // Is a live thread recording into it?
+    uint32_t thread;              // Thread number written into events
+    size_t head;                  // Events ever recorded
+    size_t tail;                  // Events ever written out
+    size_t dropped;               // Events lost because the ring was full
+    mm_trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+typedef struct tcache_bin {
+/*
+ * Singly-linked list of cached blocks of one size class, linked
+ * through aof.fb.next.
+ */
+    block_t *head;
+    unsigned int count;
+} tcache_bin_t;
+
+typedef struct arena {
+/*
+ * An independent heap, living in heap region "id".
+ */
+    block_t *remote;                  // Blocks freed by other threads, no lock
+    pthread_mutex_t lock;             // Guards everything below
+    unsigned int id;                  // Index into arenas[] and region number
+    block_t *heap_listp;              // Pointer to first block, NULL until used
+    block_t *seg_listsp[SEG_SIZE];    // Array of free lists
+    word_t binmap[BINMAP_WORDS];      // Bit i set when seg_listsp[i] non-empty
+    block_t *dirty_head;              // Most recently dirtied free block
+    block_t *dirty_tail;              // Least recently dirtied free block
+    unsigned int ticks;               // Allocations, for timing dirty sweeps
+    size_t extends;                   // Calls to extend_heap
+    size_t grow;                      // Growth step, see grow_size
+    word_t grow_time;                 // Time of the last growth (ms, or ticks)
+    slab_run_t *slab_runs[SLAB_CLASSES]; // Runs with free objects, per size
+} arena_t;
+
 /* Global variables */
-static block_t *heap_listp = NULL;      // Pointer to first block
-static block_t *seg_listsp[SEG_SIZE];   // Array of free lists 
+static arena_t arenas[MAX_ARENAS];    // Arena i owns heap region i
+static unsigned int num_arenas = 0;   // Arenas in use, 0 before initialization
+static unsigned int next_arena = 0;   // Round-robin thread assignment counter
+static size_t mmap_threshold = MMAP_THRESHOLD; // Smallest mmapped request
+static size_t mmap_threshold_min = MMAP_THRESHOLD; // Smallest mmap_threshold ever set
+static size_t trim_threshold = TRIM_THRESHOLD; // Smallest trimmed heap end
+static size_t purge_threshold = PURGE_THRESHOLD; // Smallest purged free block
+static size_t purge_decay = 0;        // Dirty time before purging (ms), 0 if none
+static bool huge_pages = false;       // Ask memlib for a huge page heap
+static size_t grow_max = GROW_MAX;    // Largest growth step
+static size_t prefault_size = 0;      // Bytes faulted in when a heap is made
+static size_t prefault_ahead = 0;     // Bytes prefault_run keeps faulted in
+static unsigned int prefault_pending = 0; // Arenas for prefault_run, as bits
+static uintptr_t prefault_end[MAX_ARENAS]; // End of faulted-in memory, per arena
+static bool prefault_started = false; // Has prefault_run been started?
+static pthread_t prefault_worker;     // Runs prefault_run
+static pthread_mutex_t prefault_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the above
+static pthread_cond_t prefault_cond = PTHREAD_COND_INITIALIZER; // Signals prefault_pending
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER; // Guards setup
+static slab_run_t *slab_unused = NULL; // Runs not used by any arena
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the above
+static thread_stats_t *stats_threads = NULL; // Counters of registered threads
+static thread_stats_t stats_retired;  // Counters of threads that have exited
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the above
+static size_t prof_rate = 0;          // Mean bytes between samples, 0 if off
+static prof_sample_t **prof_table = NULL; // Live samples by address
+static mm_pool_t *prof_pool = NULL;   // Storage for samples
+static prof_sample_t *prof_stacks[PROF_BUCKETS]; // Samples by stack, while dumping
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the above
+static bool trace_on = false;         // Is a trace being recorded?
+static bool trace_stopping = false;   // Tells the writer thread to finish
+static int trace_fd = -1;             // File the trace is written to
+static word_t trace_epoch = 0;        // Time the trace started (ns)
+static pthread_t trace_writer;        // Drains the rings into trace_fd
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // Guards the above
+static uint32_t trace_threads = 0;    // Thread numbers handed out, atomically
+static trace_ring_t *trace_rings = NULL; // Rings of all threads, pushed lock-free
+static unsigned int trace_claiming = 0; // Threads looking for a ring, atomically
+
+/* Thread-local variables */
+static __thread arena_t *thread_arena = NULL;     // This thread's arena
+static __thread tcache_bin_t tcache[TCACHE_BINS]; // This thread's block cache
+static __thread bool tcache_registered = false;  // Exit destructor installed?
+static pthread_key_t tcache_key;                  // Flushes tcache on thread exit
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+static __thread thread_stats_t thread_stats;     // This thread's counters
+static __thread bool stats_registered = false;   // In stats_threads?
+static __thread intptr_t prof_countdown = 0;     // Bytes until the next sample
+static __thread uint64_t prof_seed = 0;          // prof_next's state, 0 if unseeded
+static __thread bool prof_busy = false;          // Inside the profiler?
+static __thread trace_ring_t *trace_ring = NULL; // This thread's trace ring
+static __thread bool trace_busy = false;         // Inside a traced call?
 
 /* Function prototypes for internal helper routines */
-static block_t *extend_heap(size_t size);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
-static block_t *coalesce(block_t *block);
+static void init_arenas(void);
+static bool init_heap(arena_t *arena);
+static bool ensure_init(void);
+static arena_t *get_arena(void);
+static arena_t *block_arena(block_t *block);
+static block_t *arena_alloc(arena_t *arena, size_t asize);
+static void *meta_alloc(size_t alignment, size_t size);
+static void meta_free(void *ptr);
+static void remote_push(arena_t *arena, block_t *first, block_t *last);
+static void remote_drain(arena_t *arena);
+static block_t *alloc_block(arena_t *arena, size_t asize);
+static block_t *alloc_aligned(arena_t *arena, size_t alignment, size_t asize);
+static size_t alloc_batch(arena_t *arena, size_t size, size_t n, void **out);
+static void sort_ptrs(void **ptrs, size_t n);
+static bool pool_has_room(mm_pool_t *pool, pool_chunk_t *chunk);
+static void pool_link(mm_pool_t *pool, pool_chunk_t *chunk, bool front);
+static void pool_unlink(mm_pool_t *pool, pool_chunk_t *chunk);
+static block_t *extend_heap(arena_t *arena, size_t size, bool quiet);
+static size_t grow_size(arena_t *arena);
+static void prefault_kick(arena_t *arena);
+static void *prefault_run(void *arg);
+static void place(arena_t *arena, block_t *block, size_t asize);
+static bool resize_block(arena_t *arena, block_t *block, size_t asize);
+
+static void *map_block(size_t size);
+static void *remap_block(block_t *block, size_t size);
+static void unmap_block(block_t *block);
+static block_t *find_fit(arena_t *arena, size_t asize);
+static block_t *coalesce(arena_t *arena, block_t *block);
+static void free_block(arena_t *arena, block_t *block);
+static void purge_block(block_t *block, char *lo, char *hi);
+static void purge_dirty(arena_t *arena);
+static bool get_dirty(block_t *block);
+static bool get_purged(block_t *block);
+static void dirty_insert(arena_t *arena, block_t *block);
+static void dirty_remove(arena_t *arena, block_t *block);
+static word_t now_ms(void);
+static bool check_arena(arena_t *arena);
 
 static size_t max(size_t x, size_t y);
+static size_t min(size_t x, size_t y);
 static size_t round_up(size_t size, size_t n);
 static word_t pack(size_t size, bool alloc, bool alloc_prev);
 
@@ -216,8 +759,15 @@ static bool extract_alloc(word_t header);
 static bool get_alloc(block_t *block);
 static bool extract_alloc_prev(word_t word);
 static bool get_alloc_prev(block_t *block);
+static bool extract_mmapped(word_t word);
+static bool get_mmapped(block_t *block);
+
+static bool extract_sampled(word_t word);
+static bool get_sampled(block_t *block);
+static void set_sampled(block_t *block, bool sampled);
 
 static void write_header(block_t *block, size_t size, bool alloc, bool alloc_prev);
+static void set_alloc_prev(block_t *block, bool alloc_prev);
 static void write_footer(block_t *block, size_t size, bool alloc);
 
 static block_t *payload_to_header(void *bp);
@@ -227,9 +777,72 @@ static block_t *find_next(block_t *block);
 static word_t *find_prev_footer(block_t *block);
 static block_t *find_prev(block_t *block);
 
-static void insert_list(block_t *block);
-static void remove_list(block_t *block);
+static void insert_list(arena_t *arena, block_t *block);
+static void remove_list(arena_t *arena, block_t *block);
 static int get_seglist_size (size_t asize);
+static int next_nonempty_list(arena_t *arena, int i);
+
+static void tree_insert(block_t **root, block_t *block);
+static void tree_remove(block_t **root, block_t *block);
+static block_t *tree_best_fit(block_t *node, size_t asize);
+static block_t *tree_min(block_t *node);
+static bool tree_less(block_t *a, block_t *b);
+static bool tree_red(block_t *node);
+static void tree_rotate(block_t **root, block_t *x, bool left);
+static void tree_transplant(block_t **root, block_t *u, block_t *v);
+static long check_tree(block_t *node, block_t *parent, int i, size_t *count);
+
+static bool is_slab(void *ptr);
+static slab_run_t *slab_run_of(void *ptr);
+static size_t usable_size(void *ptr);
+static unsigned int slab_fill(arena_t *arena, tcache_bin_t *bin, size_t size);
+static void *slab_take(arena_t *arena, size_t size);
+static void slab_free(arena_t *arena, void *ptr);
+static slab_run_t *slab_new_run(arena_t *arena, size_t size);
+static void slab_link(arena_t *arena, slab_run_t *run);
+static void slab_unlink(arena_t *arena, slab_run_t *run);
+static bool check_slabs(void);
+static bool check_tcache(void);
+
+static tcache_bin_t *tcache_bin(size_t asize);
+static block_t *tcache_pop(tcache_bin_t *bin);
+static void tcache_push(tcache_bin_t *bin, block_t *block);
+static void tcache_refill(tcache_bin_t *bin, size_t asize);
+static unsigned int tcache_fill(arena_t *arena, tcache_bin_t *bin, size_t asize);
+static void tcache_flush(tcache_bin_t *bin, unsigned int n);
+static void tcache_register(void);
+static void tcache_create_key(void);
+static void tcache_destroy(void *arg);
+
+static void stats_alloc(void *bp);
+static void stats_free(void *ptr);
+static void stats_add(size_t *counter, size_t n);
+static void stats_register(void);
+static void stats_unregister(void);
+static void stats_reset(void);
+static void tree_stats(block_t *node, int i, mm_stats_t *stats);
+
+static bool prof_sample(void);
+static void *prof_malloc(size_t size) __attribute__((noinline));
+static void prof_free(void *ptr);
+static intptr_t prof_next(size_t rate);
+static prof_sample_t **prof_bucket(void *ptr);
+static prof_sample_t **prof_stack_bucket(prof_sample_t *sample);
+static void prof_printf(prof_out_t *out, const char *fmt, ...);
+static void prof_flush(prof_out_t *out);
+
+static bool trace_active(void);
+static void *trace_malloc(size_t size);
+static void *trace_calloc(size_t nmemb, size_t size);
+static void *trace_realloc(void *oldptr, size_t size);
+static void *trace_memalign(size_t alignment, size_t size);
+static void trace_free(void *ptr, size_t size, bool sized);
+static void trace_record(uint8_t op, uintptr_t ptr, size_t size,
+                         uint8_t align_log2, word_t time);
+static void trace_unregister(void);
+static void *trace_write(void *arg);
+static size_t trace_drain(void);
+static word_t now_ns(void);
 
 
 /* align: rounds up to the nearest multiple of ALIGNMENT */
@@ -239,54 +852,51 @@ static size_t align(size_t x)
 }
 
 /*
- * mm_init: initializes the heap; it is run once when heap_start == NULL.
- *          prior to any extend_heap operation, this is the heap:
- *              start            start+8           start+16
- *          INIT: | PROLOGUE_FOOTER | EPILOGUE_HEADER |
- * heap_listp ends up pointing to the epilogue header.
- * free_listp is re-initialized to NULL.
+ * adjust_size: returns the size of a block with size bytes of payload,
+ *              including overhead and meeting alignment requirements, or 0
+ *              if that size cannot be represented.
  */
-bool mm_init(void) 
+static size_t adjust_size(size_t size)
 {
-    dbg_printf("Initializing...\n");
-
-    /* Create the initial empty heap */
-    word_t *start = (word_t *)(mem_sbrk(2*wsize));
-
-    if (start == (void *)-1) 
-    {
-        dbg_printf("Not enough memory available.\n");
-        return false;
-    }
-
-    start[0] = pack(0, true, true); // Prologue footer
-    start[1] = pack(0, true, true); // Epilogue header
-    // Heap starts with first block header (epilogue)
-    heap_listp = (block_t *) &(start[1]);
+    if (size > SIZE_MAX - dsize)
+        return 0;
+    return max(2*dsize, align(size + wsize));
+}
 
-    /* Initialize segregated lists */
-    for (int i = 0; i < SEG_SIZE; i++)
-        seg_listsp[i] = NULL;
+/*
+ * mm_init: (re)initializes all arenas and builds the main heap. Secondary
+ *          arenas build their heaps when first used.
+ *          The calling thread's tcache is emptied, since its blocks belonged to
+ *          the previous heap.
+ */
+bool mm_init(void) 
+{
+    bool ok;
 
-    dbg_printf("Extending heap...\n");
+    pthread_mutex_lock(&init_lock);
+    init_arenas();
+    pthread_mutex_lock(&arenas[0].lock);
+    ok = init_heap(&arenas[0]);
+    pthread_mutex_unlock(&arenas[0].lock);
+    pthread_mutex_unlock(&init_lock);
 
-    if (extend_heap(chunksize) == NULL)
+    for (int i = 0; i < TCACHE_BINS; i++)
     {
-        dbg_printf("extend_heap(chunksize) returned NULL.\n");
-        return false;
+        tcache[i].head = NULL;
+        tcache[i].count = 0;
     }
 
-    dbg_printf("Initial heap extension successful.\n");
-    return true;
+    return ok;
 }
 
 /*
  * malloc: allocates a block with size at least (size + dsize), rounded up to
- *         the nearest 16 bytes, with a minimum of 2*dsize. Seeks a
- *         sufficiently-large unallocated block on the heap to be allocated.
- *         If no such block is found, extends heap by the maximum between
- *         chunksize and (size + dsize) rounded up to the nearest 16 bytes,
- *         and then attempts to allocate all, or a part of, that memory.
+ *         the nearest 16 bytes, with a minimum of 2*dsize. Small requests are
+ *         served from the thread's tcache without taking a lock. Otherwise
+ *         seeks a sufficiently-large unallocated block on the heap to be
+ *         allocated. If no such block is found, extends heap by the maximum
+ *         between chunksize and (size + dsize) rounded up to the nearest 16
+ *         bytes, and then attempts to allocate all, or a part of, that memory.
  *         Returns NULL on failure, otherwise returns a pointer to such block.
  *         The allocated block will not be used for further allocations until
  *         freed.
@@ -295,42 +905,63 @@ void *malloc (size_t size)
 {
     dbg_printf("Malloc(%zd), at beginning\n", size);
     size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;    // Pointer to block
     void *bp;          // Pointer to payload
 
+    if (trace_active())
+        return trace_malloc(size);
+
     /* Initialize heap if it isn't initialized */
-    if (heap_listp == NULL)
-        mm_init();
+    if (!ensure_init())
+        return NULL;
 
-    /* Ignore spurious request */
-    if (size == 0)
+    /* Ignore spurious request, and ones too large to adjust */
+    if (size == 0 || (asize = adjust_size(size)) == 0)
         return NULL;
 
-    /* Adjust block size to include overhead and meet alignment requirements */
-    asize = max(2*dsize, align(size + wsize));
-    dbg_printf("size %zd rounded to asize %zd.\n", size, asize);
+    /* Count down to the next sample of the heap profiler */
+    if (__atomic_load_n(&prof_rate, __ATOMIC_RELAXED) != 0 &&
+        (prof_countdown -= (intptr_t) min(size, INTPTR_MAX)) < 0 && prof_sample())
+        return prof_malloc(size);
 
-    /* Search the segregated lists for a fit */
-    block = find_fit(asize);
+    /* Huge requests get a mapping of their own */
+    if (size >= mmap_threshold)
+    {
+        if ((bp = map_block(size)) != NULL)
+            stats_alloc(bp);
+        return bp;
+    }
 
-    /* If no fit is found, request more memory and then place the block */
-    if (block == NULL)
-    {  
-        extendsize = max(asize, chunksize);
-        dbg_printf("No fit found, extending heap by %zd.\n", extendsize);
-        block = extend_heap(extendsize);
+    dbg_printf("size %zd rounded to asize %zd.\n", size, asize);
 
-        /* Check that extend_heap does not return NULL (error) */
-        if (block == NULL)
-        {
-            dbg_printf("extend_heap(%zd) returned NULL.\n", extendsize);
-            return NULL;
-        }
+    /* Small sizes are served from the thread cache */
+    if (size <= slab_max_size)
+    {
+        /* Bins of slab objects are indexed by object size */
+        tcache_bin_t *bin = tcache_bin(align(size));
+        if (bin->head == NULL)
+            tcache_refill(bin, align(size));
+        /* Fall back to the heap if the slab region is full */
+        if ((block = tcache_pop(bin)) == NULL)
+            block = arena_alloc(get_arena(), asize);
+    }
+    else if (asize <= tcache_max_size)
+    {
+        tcache_bin_t *bin = tcache_bin(asize);
+        if (bin->head == NULL)
+            tcache_refill(bin, asize);
+        block = tcache_pop(bin);
+    }
+    else
+    {
+        block = arena_alloc(get_arena(), asize);
     }
 
-    place(block, asize);
+    if (block == NULL)
+        return NULL;
+
     bp = header_to_payload(block);
+    stats_alloc(bp);
     dbg_printf("Malloc(%zd) --> %p, completed.\n", size, bp);
     return bp;
 }
@@ -338,23 +969,138 @@ void *malloc (size_t size)
 /*
  * free: Frees the block such that it is no longer allocated while doing
  *       necessary coalescing. Block will be available for use on malloc.
+ *       Small blocks are kept in the thread's tcache instead.
  */
 void free (void *ptr) 
 {    
     block_t *block;
+    arena_t *arena;
+    unsigned int region;  // Looked up once; it costs a division
+    bool slab;
+    size_t size;
+
+    if (trace_active())
+    {
+        trace_free(ptr, 0, false);
+        return;
+    }
 
     if (ptr == NULL) 
         return;
 
+    stats_free(ptr);
+
+    /* Slab objects have no header; the run gives their size */
+    block = payload_to_header(ptr);
+    region = mem_region_of(ptr);
+    slab = region == SLAB_REGION;
+    size = slab ? slab_run_of(ptr)->size : get_size(block);
+
+    if (!slab && get_sampled(block))
+        prof_free(ptr);
+
+    if (!slab && get_mmapped(block))
+    {
+        unmap_block(block);
+        return;
+    }
+
+    /* Heap blocks of slab sizes (from a full slab region) are not cached */
+    if (size <= tcache_max_size && (slab || size > slab_max_size))
+    {
+        tcache_bin_t *bin = tcache_bin(size);
+        if (bin->count >= TCACHE_COUNT)
+            tcache_flush(bin, TCACHE_BATCH);
+        tcache_push(bin, block);
+        return;
+    }
+
+    /* Another thread's arena frees the block on its next allocation */
+    arena = &arenas[region];
+    if (arena != thread_arena)
+    {
+        remote_push(arena, block, block);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    free_block(arena, block); 
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * free_sized: frees a block that was allocated with size bytes. The thread
+ *             cache bin of a heap block is chosen from size, not from the
+ *             block's header, and that of a slab object from its run's
+ *             size. Header flags are only checked if the block may have a
+ *             mapping of its own (mmap_threshold was once size or less) or
+ *             may be sampled (the heap profiler has run). Blocks too large
+ *             for the cache, mapped and sampled blocks are freed as by free.
+ */
+void free_sized(void *ptr, size_t size)
+{
+    size_t asize;  // Size of the block's bin
+    tcache_bin_t *bin;
+    block_t *block;
+
+    if (trace_active())
+    {
+        trace_free(ptr, size, true);
+        return;
+    }
+
+    if (ptr == NULL)
+        return;
+
+    dbg_requires(size <= usable_size(ptr));
+
+    /* Same bin choice as malloc; small heap blocks go to free */
     block = payload_to_header(ptr);
-    /* Coalesce removes the block from its seglist and coalesces */
-    coalesce(block); 
+    if (size <= slab_max_size)
+        asize = (size != 0 && is_slab(ptr)) ? slab_run_of(ptr)->size : 0;
+    else if (size >= __atomic_load_n(&mmap_threshold_min, __ATOMIC_RELAXED) &&
+             get_mmapped(block))
+        asize = 0;
+    else if (__atomic_load_n(&prof_table, __ATOMIC_RELAXED) != NULL &&
+             get_sampled(block))
+        asize = 0;
+    else
+        asize = adjust_size(size);
+
+    if (asize == 0 || asize > tcache_max_size)
+    {
+        free(ptr);
+        return;
+    }
+
+    stats_free(ptr);
+    bin = tcache_bin(asize);
+    if (bin->count >= TCACHE_COUNT)
+        tcache_flush(bin, TCACHE_BATCH);
+    tcache_push(bin, block);
+}
+
+/*
+ * malloc_usable_size: returns the number of bytes that can be used at ptr,
+ *                     at least what it was allocated with, or 0 for NULL.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+    return usable_size(ptr);
 }
 
 /*
  * realloc: returns a pointer to an allocated region of at least size bytes:
  *          if ptrv is NULL, then call malloc(size);
  *          if size == 0, then call free(ptr) and returns NULL;
+ *          if the block has a mapping of its own and size is still at least
+ *          mmap_threshold, resizes the mapping;
+ *          if the block is in the thread's arena and can be resized where
+ *          it is (see resize_block), returns ptr; a block of another
+ *          arena is only kept if it has room and would not be more than
+ *          half empty, since that arena's lock is not taken;
  *          else allocates new region of memory, copies old data to new memory,
  *          and then free old block. Returns old block if realloc fails or
  *          returns new pointer on success.
@@ -362,9 +1108,19 @@ void free (void *ptr)
 void *realloc(void *oldptr, size_t size) 
 {
     block_t *bp = payload_to_header(oldptr);
+    arena_t *arena;
+    size_t asize;
     size_t copysize;
+    size_t oldsize;
+    bool resized;
     void *newptr;
 
+    if (trace_active())
+        return trace_realloc(oldptr, size);
+
+    stats_register();
+    stats_add(&thread_stats.reallocs, 1);
+
     /* If size == 0, then free block and return NULL */
     if (size == 0)
     {
@@ -376,6 +1132,54 @@ void *realloc(void *oldptr, size_t size)
     if (oldptr == NULL)
         return malloc(size);
 
+    /* A request too large to adjust fails, leaving the block */
+    if (adjust_size(size) == 0)
+        return NULL;
+
+    if (is_slab(oldptr))
+    {
+        /* The object already has room */
+        if (size <= slab_run_of(oldptr)->size)
+            return oldptr;
+    }
+    else if (get_sampled(bp))
+    {
+        /* Move the block, so that its sample is dropped and a new one drawn */
+    }
+    else if (get_mmapped(bp))
+    {
+        /* Resize the mapping; on failure the original block is left untouched */
+        if (size >= mmap_threshold)
+        {
+            oldsize = usable_size(oldptr);
+            if ((newptr = remap_block(bp, size)) != NULL)
+                stats_add(&thread_stats.live, usable_size(newptr) - oldsize);
+            return newptr;
+        }
+    }
+    else if (size < mmap_threshold && block_arena(bp) != thread_arena)
+    {
+        /* Another thread's arena is not locked: keep the block if it has
+           room and would not be more than half empty, else move it */
+        asize = adjust_size(size);
+        if (asize <= get_size(bp) && get_size(bp) / 2 <= asize)
+            return oldptr;
+    }
+    else if (size < mmap_threshold)
+    {
+        /* Try to grow or shrink the block in place */
+        oldsize = usable_size(oldptr);
+        arena = thread_arena;
+        pthread_mutex_lock(&arena->lock);
+        resized = resize_block(arena, bp, adjust_size(size));
+        pthread_mutex_unlock(&arena->lock);
+        if (resized)
+        {
+            stats_add(&thread_stats.live, usable_size(oldptr) - oldsize);
+            return oldptr;
+        }
+    }
+
     /* Otherwise, proceed with reallocation */
     newptr = malloc(size);
     /* If malloc fails, the original block is left untouched */
@@ -383,7 +1187,7 @@ void *realloc(void *oldptr, size_t size)
         return NULL;
 
     /* Copy the old data */
-    copysize = get_payload_size(bp); // gets size of old payload
+    copysize = usable_size(oldptr); // gets size of old payload
     if(size < copysize)
         copysize = size;
     memcpy(newptr, oldptr, copysize);
@@ -404,160 +1208,2576 @@ void *calloc(size_t nmemb, size_t size)
     void *bp;
     size_t asize = nmemb * size;
 
+    if (trace_active())
+        return trace_calloc(nmemb, size);
+
     /* Check if multiplication overflowed */
-    if (asize/nmemb != size)
+    if (nmemb != 0 && asize/nmemb != size)
         return NULL;
     
     bp = malloc(asize);
     if (bp == NULL)
         return NULL;
 
-    /* Initialize all bits to 0 */
-    memset(bp, 0, asize);
+    /* Initialize all bits to 0; fresh mappings already are */
+    if (is_slab(bp) || !get_mmapped(payload_to_header(bp)))
+        memset(bp, 0, asize);
 
     return bp;
 }
 
-/* mm_checkheap: checks the heap for correctness; returns true if
- *               the heap is correct, and false otherwise.
- *               can call this function using mm_checkheap(__LINE__);
- *               to identify the line number of the call site.
+/*
+ * memalign: allocates a block with at least size bytes of payload, aligned
+ *           to alignment bytes, which must be a power of two. Alignments of
+ *           16 bytes or less are what malloc already gives. Otherwise, the
+ *           block is cut out of a larger one (see alloc_aligned), from the
+ *           thread's arena or else from the main heap.
+ *           Returns NULL on failure.
  */
-bool mm_checkheap(int lineno)
+void *memalign(size_t alignment, size_t size)
 {
-    bool check = true;
-    block_t *ptr;       // Generic block pointer for checking 
-
-    /*** Checking epilogue and prologue blocks ***/
-    ptr = heap_listp; // Prologue pointer
-    /* Check prologue size */
-    if (get_size(ptr) != 0)
-        check = false;
-    /* Check that prologue is at beginning */
-    if (ptr != mem_heap_lo())
-        check = false;
-    /* Check allocation status */
-    if (!get_alloc(ptr))
-        check = false;
+    arena_t *arena;
+    block_t *block;
+    size_t asize;
 
-    ptr = (block_t *)((char *)mem_heap_hi() - (wsize-1)); // Epilogue pointer
-    /* Check epilogue size */
-    if (get_size(ptr) != 0)
-        check = false;
-    /* Check allocation status */
-    if (!get_alloc(ptr))
-        check = false;
+    if (trace_active())
+        return trace_memalign(alignment, size);
 
-    /* Return if error */
-    if (!check)
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
     {
-        dbg_printf("Failed mm_checkheap at lineno: %d", lineno);
-        return false;   
+        errno = EINVAL;
+        return NULL;
     }
 
-    /*** Iterating through heap while making multiple checks ***/
-    ptr = heap_listp;     // Starting at beginning of heap
-    int wrap_count = 0;   // Increment on epilogue and prologue 
-    block_t *next_ptr;    // The next block from the current one
-    while (wrap_count < 2)
+    if (alignment <= ALIGNMENT)
+        return malloc(size);
+
+    if (!ensure_init())
+        return NULL;
+
+    /* Ignore spurious request, and ones that cannot fit with their padding */
+    if (size == 0 || alignment > SIZE_MAX/4 || size > SIZE_MAX/2 - alignment)
+        return NULL;
+
+    asize = adjust_size(size);
+
+    arena = get_arena();
+    pthread_mutex_lock(&arena->lock);
+    block = alloc_aligned(arena, alignment, asize);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block == NULL && arena != &arenas[0])
     {
-        /* Iterate on prologue+epilogue */
-        if (get_size(ptr) == 0)
-            wrap_count++;
+        pthread_mutex_lock(&arenas[0].lock);
+        block = alloc_aligned(&arenas[0], alignment, asize);
+        pthread_mutex_unlock(&arenas[0].lock);
+    }
 
-        /* Allocated blocks */ 
-        else if (get_alloc(ptr))
-        {
-            /* Check alignment */
-            if (((unsigned int)ptr % ALIGNMENT) != 0)
-                check = false;
-            /* Check Header according to specification above */
-            next_ptr = find_next(ptr);
-            if (get_alloc(next_ptr) && !get_alloc_prev(next_ptr))
-                check = false;
-            if ((get_size(ptr) % ALIGNMENT) != 0)
-                check = false;
-        }
+    if (block == NULL)
+        return NULL;
+
+    stats_alloc(header_to_payload(block));
+    dbg_printf("Memalign(%zd, %zd) --> %p.\n", alignment, size,
+               header_to_payload(block));
+    return header_to_payload(block);
+}
+
+/*
+ * posix_memalign: stores in *memptr a block from memalign. Returns EINVAL if
+ *                 alignment is not a power of two multiple of sizeof(void *),
+ *                 ENOMEM if no memory is available, and 0 otherwise.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *bp;
+
+    if (alignment == 0 || alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    bp = memalign(alignment, size);
+    if (bp == NULL && size != 0)
+        return ENOMEM;
+
+    *memptr = bp;
+    return 0;
+}
+
+/*
+ * aligned_alloc: the C11 name for memalign.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+/*
+ * mm_malloc_batch: allocates n blocks of size bytes each, storing pointers
+ *                  to them in out[0..n-1]. The blocks are carved from the
+ *                  thread's arena under a single lock acquisition: slab
+ *                  objects from its runs, other blocks from one free block
+ *                  or heap extension large enough for all of them (see
+ *                  alloc_batch). Whatever cannot be carved that way is
+ *                  allocated one at a time through malloc. Returns the
+ *                  number of blocks allocated, less than n on failure.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+    arena_t *arena;
+    size_t count = 0;
+
+    if (trace_active())
+    {
+        trace_busy = true;
+        count = mm_malloc_batch(size, n, out);
+        for (size_t i = 0; i < count; i++)
+            trace_record(MM_TRACE_MALLOC, (uintptr_t) out[i], size, 0, now_ns());
+        trace_busy = false;
+        return count;
+    }
+
+    if (!ensure_init())
+        return 0;
+
+    /* Ignore spurious request */
+    if (size == 0)
+        return 0;
+
+    if (size < mmap_threshold)
+    {
+        arena = get_arena();
+        pthread_mutex_lock(&arena->lock);
+        count = alloc_batch(arena, size, n, out);
+        pthread_mutex_unlock(&arena->lock);
+        for (size_t i = 0; i < count; i++)
+            stats_alloc(out[i]);
+    }
+
+    for (; count < n; count++)
+    {
+        if ((out[count] = malloc(size)) == NULL)
+            break;
+    }
+
+    dbg_printf("Malloc_batch(%zd, %zd) --> %zd blocks.\n", size, n, count);
+    return count;
+}
+
+/*
+ * mm_free_batch: frees the n blocks in ptrs, which may contain NULLs. The
+ *                pointers are sorted in place by address first, so blocks
+ *                that are neighbours on the heap are merged and coalesced
+ *                with the rest of the heap once. Blocks of the thread's own
+ *                arena are freed under its lock, taken once; consecutive
+ *                blocks of another arena are chained and pushed onto its
+ *                remote queue together. The blocks bypass the thread cache.
+ */
+void mm_free_batch(void **ptrs, size_t n)
+{
+    arena_t *arena;
+    arena_t *locked = NULL;  // Arena whose lock is held
+    arena_t *remote = NULL;  // Arena of the chain being built
+    block_t *first = NULL;   // Chain of blocks for remote
+    block_t *last = NULL;
+    block_t *block;
+    size_t size;
+
+    if (trace_active())
+    {
+        trace_busy = true;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (ptrs[i] != NULL)
+                trace_record(MM_TRACE_FREE, (uintptr_t) ptrs[i], 0, 0, now_ns());
+        }
+        mm_free_batch(ptrs, n);
+        trace_busy = false;
+        return;
+    }
+
+    /* Drop samples first, as prof_lock is never taken under an arena lock */
+    for (size_t i = 0; i < n; i++)
+    {
+        if (ptrs[i] != NULL && !is_slab(ptrs[i]) &&
+            get_sampled(payload_to_header(ptrs[i])))
+            prof_free(ptrs[i]);
+    }
+
+    sort_ptrs(ptrs, n);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        void *ptr = ptrs[i];
+
+        if (ptr == NULL)
+            continue;
+
+        stats_free(ptr);
+        block = payload_to_header(ptr);
+        if (is_slab(ptr))
+            arena = &arenas[slab_run_of(ptr)->arena];
+        else if (get_mmapped(block))
+        {
+            unmap_block(block);
+            continue;
+        }
+        else
+            arena = block_arena(block);
+
+        /* Merge the blocks that follow this one on the heap */
+        if (!is_slab(ptr))
+        {
+            size = get_size(block);
+            while (i + 1 < n && ptrs[i + 1] == (char *) ptr + size)
+            {
+                stats_free(ptrs[++i]);
+                size += get_size(payload_to_header(ptrs[i]));
+            }
+            write_header(block, size, true, get_alloc_prev(block));
+        }
+
+        if (arena != thread_arena)
+        {
+            if (arena != remote)
+            {
+                if (remote != NULL)
+                    remote_push(remote, first, last);
+                remote = arena;
+                first = NULL;
+                last = block;
+            }
+            block->aof.fb.next = first;
+            first = block;
+            continue;
+        }
+
+        if (locked == NULL)
+        {
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        if (is_slab(ptr))
+            slab_free(arena, ptr);
+        else
+            free_block(arena, block);
+    }
+
+    if (remote != NULL)
+        remote_push(remote, first, last);
+    if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+}
+
+/*
+ * mm_region_create: returns a new, empty scoped region, or NULL on failure.
+ */
+mm_region_t *mm_region_create(void)
+{
+    mm_region_t *region = meta_alloc(0, sizeof(mm_region_t));
+
+    if (region == NULL)
+        return NULL;
+
+    region->head = NULL;
+    region->chunk = NULL;
+    region->cur = NULL;
+    region->end = NULL;
+    return region;
+}
+
+/*
+ * mm_region_alloc: allocates size bytes, rounded up to 16, from a scoped
+ *                  region by bumping a pointer through its current chunk.
+ *                  When it is full, moves on to the next chunk kept from
+ *                  before a reset, or else takes a new chunk of
+ *                  REGION_CHUNK_SIZE bytes, or of size if it is larger,
+ *                  from meta_alloc.
+ *                  Returns NULL on failure. The space cannot be freed on
+ *                  its own, only by resetting or destroying the region.
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size)
+{
+    region_chunk_t *chunk;
+    size_t asize;
+    void *bp;
+
+    /* Ignore spurious request */
+    if (size == 0 || size > SIZE_MAX/2)
+        return NULL;
+
+    asize = align(size);
+
+    if (asize > (size_t)(region->end - region->cur))
+    {
+        chunk = (region->chunk != NULL) ? region->chunk->next : region->head;
+
+        /* Add a chunk after the current one if the next is missing or small */
+        if (chunk == NULL || chunk->size < asize)
+        {
+            size_t csize = max(REGION_CHUNK_SIZE, asize);
+            if ((chunk = meta_alloc(0, sizeof(region_chunk_t) + csize)) == NULL)
+                return NULL;
+            dbg_printf("New region chunk %p of %zd bytes.\n", chunk, csize);
+            chunk->size = csize;
+            if (region->chunk != NULL)
+            {
+                chunk->next = region->chunk->next;
+                region->chunk->next = chunk;
+            }
+            else
+            {
+                chunk->next = region->head;
+                region->head = chunk;
+            }
+        }
+
+        region->chunk = chunk;
+        region->cur = (char *)(chunk + 1);
+        region->end = region->cur + chunk->size;
+    }
+
+    bp = region->cur;
+    region->cur += asize;
+    return bp;
+}
+
+/*
+ * mm_region_reset: frees everything allocated from a scoped region in
+ *                  constant time, by moving its bump pointer back to the
+ *                  start of its first chunk. The chunks are kept for
+ *                  reuse, so the heap and its lists are not touched.
+ */
+void mm_region_reset(mm_region_t *region)
+{
+    region->chunk = region->head;
+    if (region->head != NULL)
+    {
+        region->cur = (char *)(region->head + 1);
+        region->end = region->cur + region->head->size;
+    }
+    else
+    {
+        region->cur = NULL;
+        region->end = NULL;
+    }
+}
+
+/*
+ * mm_region_destroy: gives every chunk of a scoped region back to the heap,
+ *                    then frees the region itself.
+ */
+void mm_region_destroy(mm_region_t *region)
+{
+    region_chunk_t *chunk;
+    region_chunk_t *next;
+
+    if (region == NULL)
+        return;
+
+    for (chunk = region->head; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        meta_free(chunk);
+    }
+    meta_free(region);
+}
+
+/*
+ * mm_pool_create: returns a new pool of objects of obj_size bytes aligned
+ *                 to align bytes, a power of two, or to ALIGNMENT if align
+ *                 is 0. Returns NULL if align is invalid or on failure.
+ */
+mm_pool_t *mm_pool_create(size_t obj_size, size_t align)
+{
+    mm_pool_t *pool;
+
+    if (align == 0)
+        align = ALIGNMENT;
+    if ((align & (align - 1)) != 0 || align > POOL_CHUNK_SIZE ||
+        obj_size == 0 || obj_size > SIZE_MAX/64)
+        return NULL;
+
+    /* An object holds the free list link while it is free */
+    align = max(align, sizeof(void *));
+
+    if ((pool = meta_alloc(0, sizeof(mm_pool_t))) == NULL)
+        return NULL;
+
+    pool->stride = round_up(max(obj_size, sizeof(void *)), align);
+    pool->first = round_up(sizeof(pool_chunk_t), align);
+    pool->chunk_size = POOL_CHUNK_SIZE;
+    while ((pool->chunk_size - pool->first) / pool->stride < POOL_MIN_OBJS)
+        pool->chunk_size <<= 1;
+    pool->head = NULL;
+    pool->tail = NULL;
+
+    dbg_printf("Pool of %zd-byte objects in %zd-byte chunks.\n",
+               pool->stride, pool->chunk_size);
+    return pool;
+}
+
+/*
+ * mm_pool_alloc: takes an object from the first chunk of the pool, which
+ *                has room if any chunk has: a freed object if there is
+ *                one, else the next object never handed out. If no chunk
+ *                has room, a new chunk is allocated from the heap.
+ *                Returns NULL on failure.
+ */
+void *mm_pool_alloc(mm_pool_t *pool)
+{
+    pool_chunk_t *chunk = pool->head;
+    void *obj;
+
+    if (chunk == NULL || !pool_has_room(pool, chunk))
+    {
+        /* Chunks are aligned to their size, so an object finds its chunk */
+        if ((chunk = meta_alloc(pool->chunk_size, pool->chunk_size)) == NULL)
+            return NULL;
+        dbg_printf("New pool chunk %p.\n", chunk);
+        chunk->free = NULL;
+        chunk->bump = (char *) chunk + pool->first;
+        chunk->live = 0;
+        pool_link(pool, chunk, true);
+    }
+
+    if ((obj = chunk->free) != NULL)
+        chunk->free = *(void **) obj;
+    else
+    {
+        obj = chunk->bump;
+        chunk->bump += pool->stride;
+    }
+    chunk->live++;
+
+    /* A full chunk moves behind the ones with room */
+    if (!pool_has_room(pool, chunk))
+    {
+        pool_unlink(pool, chunk);
+        pool_link(pool, chunk, false);
+    }
+
+    return obj;
+}
+
+/*
+ * mm_pool_free: returns an object to its chunk. A chunk that was full
+ *               moves to the front of the pool. A chunk that becomes empty
+ *               is given back to the heap, unless no other chunk has room.
+ */
+void mm_pool_free(mm_pool_t *pool, void *obj)
+{
+    pool_chunk_t *chunk;
+    bool was_full;
+
+    if (obj == NULL)
+        return;
+
+    chunk = (pool_chunk_t *)((uintptr_t) obj & ~(uintptr_t)(pool->chunk_size - 1));
+    was_full = !pool_has_room(pool, chunk);
+
+    *(void **) obj = chunk->free;
+    chunk->free = obj;
+    chunk->live--;
+
+    if (was_full)
+    {
+        pool_unlink(pool, chunk);
+        pool_link(pool, chunk, true);
+    }
+
+    if (chunk->live == 0 && ((chunk->prev != NULL) ||
+        (chunk->next != NULL && pool_has_room(pool, chunk->next))))
+    {
+        dbg_printf("Releasing empty pool chunk %p.\n", chunk);
+        pool_unlink(pool, chunk);
+        meta_free(chunk);
+    }
+}
+
+/*
+ * mm_pool_destroy: gives every chunk of the pool back to the heap, then
+ *                  frees the pool itself.
+ */
+void mm_pool_destroy(mm_pool_t *pool)
+{
+    pool_chunk_t *chunk;
+    pool_chunk_t *next;
+
+    if (pool == NULL)
+        return;
+
+    for (chunk = pool->head; chunk != NULL; chunk = next)
+    {
+        next = chunk->next;
+        meta_free(chunk);
+    }
+    meta_free(pool);
+}
+
+/*
+ * mm_get_stats: fills in stats. Call counters and live bytes are summed
+ *               over every thread's counters. Free space is measured by
+ *               walking each arena's segregated lists under its lock, after
+ *               freeing the blocks waiting in its remote queue.
+ *               Returns false if the allocator cannot be initialized.
+ */
+bool mm_get_stats(mm_stats_t *stats)
+{
+    thread_stats_t *ts;
+
+    if (!ensure_init())
+        return false;
+
+    memset(stats, 0, sizeof(mm_stats_t));
+
+    pthread_mutex_lock(&stats_lock);
+    stats->mallocs = stats_retired.mallocs;
+    stats->frees = stats_retired.frees;
+    stats->reallocs = stats_retired.reallocs;
+    stats->live_bytes = stats_retired.live;
+    for (ts = stats_threads; ts != NULL; ts = ts->next)
+    {
+        stats->mallocs += __atomic_load_n(&ts->mallocs, __ATOMIC_RELAXED);
+        stats->frees += __atomic_load_n(&ts->frees, __ATOMIC_RELAXED);
+        stats->reallocs += __atomic_load_n(&ts->reallocs, __ATOMIC_RELAXED);
+        stats->live_bytes += __atomic_load_n(&ts->live, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    for (unsigned int a = 0; a < num_arenas; a++)
+    {
+        arena_t *arena = &arenas[a];
+
+        pthread_mutex_lock(&arena->lock);
+        if (arena->heap_listp != NULL)
+            remote_drain(arena);
+        stats->heap_extends += arena->extends;
+        for (int i = 0; arena->heap_listp != NULL && i < SEG_SIZE; i++)
+        {
+            if (i >= TREE_FIRST_LIST)
+                tree_stats(arena->seg_listsp[i], i, stats);
+            else for (block_t *block = arena->seg_listsp[i]; block != NULL;
+                      block = block->aof.fb.next)
+            {
+                stats->list_bytes[i] += get_size(block);
+                stats->list_blocks[i]++;
+                stats->largest_free = max(stats->largest_free, get_size(block));
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    for (int i = 0; i < SEG_SIZE; i++)
+    {
+        stats->free_bytes += stats->list_bytes[i];
+        stats->free_blocks += stats->list_blocks[i];
+    }
+
+    stats->heap_size = mem_heapsize();
+    stats->peak_heap_size = mem_peak_heapsize();
+    stats->sbrk_bytes = mem_sbrk_total();
+    stats->mapped_bytes = mem_mapsize();
+    if (stats->free_bytes != 0)
+        stats->fragmentation = 1.0 - (double) stats->largest_free / stats->free_bytes;
+
+    return true;
+}
+
+/*
+ * mm_prof_dump: writes the live samples of the heap profiler to fd, in the
+ *               text format of pprof's heap profiles. Samples with the same
+ *               stack are merged into one line. Totals of all allocations
+ *               are not kept and are written as 0. The process's mappings
+ *               follow, for symbolization. Returns false if a write fails.
+ */
+bool mm_prof_dump(int fd)
+{
+    prof_out_t out = { .fd = fd, .ok = true, .len = 0 };
+    prof_sample_t *sample;
+    prof_sample_t **link;
+    prof_sample_t **bucket;
+    size_t objs = 0;
+    size_t bytes = 0;
+    ssize_t n;
+    int maps;
+
+    prof_busy = true;
+    pthread_mutex_lock(&prof_lock);
+
+    /* Bucket the samples by stack, so that merging them is linear */
+    for (int b = 0; prof_table != NULL && b < PROF_BUCKETS; b++)
+    {
+        for (sample = prof_table[b]; sample != NULL; sample = sample->next)
+        {
+            objs++;
+            bytes += sample->size;
+            bucket = prof_stack_bucket(sample);
+            sample->same = *bucket;
+            *bucket = sample;
+        }
+    }
+    prof_printf(&out, "heap profile: %zu: %zu [0: 0] @ heap_v2/%zu\n",
+                objs, bytes, __atomic_load_n(&prof_rate, __ATOMIC_RELAXED));
+
+    /* One line per stack: unlink the samples that share the first's stack */
+    for (int b = 0; b < PROF_BUCKETS; b++)
+    {
+        while ((sample = prof_stacks[b]) != NULL)
+        {
+            objs = 0;
+            bytes = 0;
+            for (link = &prof_stacks[b]; *link != NULL; )
+            {
+                if ((*link)->depth != sample->depth ||
+                    memcmp((*link)->stack, sample->stack,
+                           sample->depth * sizeof(void *)) != 0)
+                {
+                    link = &(*link)->same;
+                    continue;
+                }
+                objs++;
+                bytes += (*link)->size;
+                *link = (*link)->same;
+            }
+            prof_printf(&out, "%zu: %zu [0: 0] @", objs, bytes);
+            for (int i = 0; i < sample->depth; i++)
+                prof_printf(&out, " %p", sample->stack[i]);
+            prof_printf(&out, "\n");
+        }
+    }
+
+    pthread_mutex_unlock(&prof_lock);
+
+    prof_printf(&out, "\nMAPPED_LIBRARIES:\n");
+    if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0)
+    {
+        prof_flush(&out);
+        while ((n = read(maps, out.buf, sizeof(out.buf))) > 0)
+        {
+            out.len = n;
+            prof_flush(&out);
+        }
+        close(maps);
+    }
+    prof_flush(&out);
+
+    prof_busy = false;
+    return out.ok;
+}
+
+/*
+ * mm_trace_start: starts recording every call to the allocation functions
+ *                 into fd, which gets an mm_trace_header_t followed by
+ *                 mm_trace_event_t records. Each thread appends events to
+ *                 a ring of its own, and a writer thread copies them to fd
+ *                 every TRACE_FLUSH_US microseconds. Returns false if a
+ *                 trace is already being recorded or on failure.
+ */
+bool mm_trace_start(int fd)
+{
+    mm_trace_header_t header;
+    bool ok = false;
+
+    if (!ensure_init())
+        return false;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = MM_TRACE_VERSION;
+    header.event_size = sizeof(mm_trace_event_t);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd < 0 && write(fd, &header, sizeof(header)) == sizeof(header))
+    {
+        /* Events left in the rings by the last trace are dropped */
+        for (trace_ring_t *ring = trace_rings; ring != NULL; ring = ring->next)
+        {
+            ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            ring->dropped = 0;
+        }
+        trace_fd = fd;
+        trace_epoch = now_ns();
+        trace_stopping = false;
+        if (pthread_create(&trace_writer, NULL, trace_write, NULL) == 0)
+        {
+            __atomic_store_n(&trace_on, true, __ATOMIC_RELEASE);
+            ok = true;
+        }
+        else
+            trace_fd = -1;
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return ok;
+}
+
+/*
+ * mm_trace_stop: stops recording and waits for the writer thread to write
+ *                out every recorded event. The rings of running threads
+ *                are kept for the next trace, and those of threads that
+ *                have exited are unmapped. Returns the number of events
+ *                lost to full rings.
+ */
+size_t mm_trace_stop(void)
+{
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_on)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+    __atomic_store_n(&trace_on, false, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&trace_stopping, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+
+    /* trace_fd keeps other traces out until the writer is done */
+    pthread_join(trace_writer, NULL);
+
+    /* Once no thread is looking for a ring, no new one can be claimed */
+    while (__atomic_load_n(&trace_claiming, __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+
+    pthread_mutex_lock(&trace_lock);
+    for (trace_ring_t **link = &trace_rings, *ring; (ring = *link) != NULL; )
+    {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (__atomic_exchange_n(&ring->owned, true, __ATOMIC_ACQUIRE))
+            link = &ring->next;
+        else
+        {
+            *link = ring->next;
+            mem_unmap_meta(ring, sizeof(trace_ring_t));
+        }
+    }
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+
+    return dropped;
+}
+
+/*
+ * mm_setopt: sets a tunable parameter. Returns false if the option is
+ *            unknown or the value is out of range.
+ */
+bool mm_setopt(mm_option_t option, size_t value)
+{
+    switch (option)
+    {
+        case MM_OPT_MMAP_THRESHOLD:
+            if (value == 0)
+                return false;
+            __atomic_store_n(&mmap_threshold, value, __ATOMIC_RELAXED);
+            /* Blocks mapped under the old threshold are still around */
+            if (value < __atomic_load_n(&mmap_threshold_min, __ATOMIC_RELAXED))
+                __atomic_store_n(&mmap_threshold_min, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_TRIM_THRESHOLD:
+            if (value < min_block_size)
+                return false;
+            __atomic_store_n(&trim_threshold, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_PURGE_THRESHOLD:
+            /* Smaller blocks never span a whole page and have no dirty list links */
+            if (value < ((size_t) 1 << TREE_MIN_LOG2))
+                return false;
+            __atomic_store_n(&purge_threshold, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_PURGE_DECAY_MS:
+            __atomic_store_n(&purge_decay, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_PROF_RATE:
+            __atomic_store_n(&prof_rate, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_HUGE_PAGES:
+            /* The heap is reserved by the first allocation */
+            pthread_mutex_lock(&init_lock);
+            if (num_arenas != 0)
+            {
+                pthread_mutex_unlock(&init_lock);
+                return false;
+            }
+            huge_pages = (value != 0);
+            pthread_mutex_unlock(&init_lock);
+            return true;
+        case MM_OPT_GROW_MAX:
+            if (value < chunksize)
+                return false;
+            __atomic_store_n(&grow_max, value - value % chunksize, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_PREFAULT_SIZE:
+            __atomic_store_n(&prefault_size, value, __ATOMIC_RELAXED);
+            return true;
+        case MM_OPT_PREFAULT_AHEAD:
+            /* The thread is started once, and sleeps while the option is 0 */
+            pthread_mutex_lock(&prefault_lock);
+            if (value != 0 && !prefault_started)
+            {
+                if (pthread_create(&prefault_worker, NULL, prefault_run, NULL) != 0)
+                {
+                    pthread_mutex_unlock(&prefault_lock);
+                    return false;
+                }
+                pthread_detach(prefault_worker);
+                prefault_started = true;
+            }
+            __atomic_store_n(&prefault_ahead, value, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&prefault_lock);
+            return true;
+    }
+    return false;
+}
+
+/* mm_checkheap: checks the heap for correctness; returns true if
+ *               the heap is correct, and false otherwise.
+ *               can call this function using mm_checkheap(__LINE__);
+ *               to identify the line number of the call site.
+ *               Every arena in use is checked by check_arena, the slab
+ *               runs by check_slabs and the caller's tcache by check_tcache.
+ */
+bool mm_checkheap(int lineno)
+{
+    bool check = true;
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        arena_t *arena = &arenas[i];
+
+        pthread_mutex_lock(&arena->lock);
+        if (arena->heap_listp != NULL && !check_arena(arena))
+            check = false;
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    if (num_arenas != 0 && !check_slabs())
+        check = false;
+
+    if (!check_tcache())
+        check = false;
+
+    if (!check)
+    {
+        dbg_printf("Failed mm_checkheap at lineno: %d\n", lineno);
+    }
+
+    return check;
+}
+
+
+/******** The remaining functions below are helper and debug routines ********/
+
+
+/*
+ * init_arenas: resets every arena to an unused state and decides how many
+ *              arenas threads are spread over. Requires init_lock.
+ *              In interpositioning builds nobody else sets up the memory
+ *              system, so it is initialized here first.
+ */
+static void init_arenas(void)
+{
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+#ifndef DRIVER
+    if (mem_heap_lo() == NULL)
+        mem_init(false, huge_pages);
+#endif
+
+    for (unsigned int i = 0; i < MAX_ARENAS; i++)
+    {
+        if (num_arenas == 0)
+            pthread_mutex_init(&arenas[i].lock, NULL);
+        arenas[i].id = i;
+        arenas[i].heap_listp = NULL;
+        arenas[i].remote = NULL;
+        arenas[i].extends = 0;
+        arenas[i].grow = chunksize;
+        arenas[i].grow_time = 0;
+        for (int c = 0; c < SLAB_CLASSES; c++)
+            arenas[i].slab_runs[c] = NULL;
+    }
+    slab_unused = NULL;
+    stats_reset();
+    pthread_mutex_lock(&prefault_lock);
+    prefault_pending = 0;
+    for (unsigned int i = 0; i < MAX_ARENAS; i++)
+        __atomic_store_n(&prefault_end[i], 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prefault_lock);
+    /* Samples lived in the old heap; trace rings are mapped outside it */
+    prof_table = NULL;
+    prof_pool = NULL;
+
+    /* Two arenas per CPU keeps collisions between threads rare */
+    ncpus = (ncpus < 1) ? 1 : ncpus;
+    __atomic_store_n(&num_arenas, (unsigned int) min(2*ncpus, MAX_ARENAS),
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * init_heap: creates the initial empty heap of an arena and extends it by
+ *            chunksize. Requires the arena's lock.
+ *            prior to any extend_heap operation, this is the heap:
+ *                start            start+8           start+16
+ *            INIT: | PROLOGUE_FOOTER | EPILOGUE_HEADER |
+ *            heap_listp ends up pointing to the epilogue header, which
+ *            becomes the header of the first block once the heap is extended.
+ */
+static bool init_heap(arena_t *arena)
+{
+    dbg_printf("Initializing arena %u...\n", arena->id);
+
+    /* Create the initial empty heap; other arenas fall back to arena 0's */
+    bool quiet = arena != &arenas[0];
+    word_t *start = (word_t *)(quiet ? mem_region_try_sbrk(arena->id, 2*wsize)
+                                     : mem_region_sbrk(arena->id, 2*wsize));
+
+    if (start == (void *)-1) 
+    {
+        dbg_printf("Not enough memory available.\n");
+        return false;
+    }
+
+    start[0] = pack(0, true, true); // Prologue footer
+    start[1] = pack(0, true, true); // Epilogue header
+    // Heap starts with first block header (epilogue)
+    arena->heap_listp = (block_t *) &(start[1]);
+
+    /* Initialize segregated lists */
+    for (int i = 0; i < SEG_SIZE; i++)
+        arena->seg_listsp[i] = NULL;
+    for (int i = 0; i < BINMAP_WORDS; i++)
+        arena->binmap[i] = 0;
+    arena->dirty_head = NULL;
+    arena->dirty_tail = NULL;
+    arena->ticks = 0;
+
+    /* Take the first extensions' page faults now */
+    if (__atomic_load_n(&prefault_size, __ATOMIC_RELAXED) != 0)
+        mem_region_prefault(arena->id, __atomic_load_n(&prefault_size, __ATOMIC_RELAXED));
+
+    dbg_printf("Extending heap...\n");
+
+    if (extend_heap(arena, chunksize, quiet) == NULL)
+    {
+        dbg_printf("extend_heap(chunksize) returned NULL.\n");
+        return false;
+    }
+
+    dbg_printf("Initial heap extension successful.\n");
+    return true;
+}
+
+/*
+ * ensure_init: sets up the arenas on first use. Safe to call from several
+ *              threads at once; only the first one does the work.
+ */
+static bool ensure_init(void)
+{
+    if (__atomic_load_n(&num_arenas, __ATOMIC_ACQUIRE) != 0)
+        return true;
+
+    pthread_mutex_lock(&init_lock);
+    if (num_arenas == 0)
+        init_arenas();
+    pthread_mutex_unlock(&init_lock);
+
+    return true;
+}
+
+/*
+ * get_arena: returns the calling thread's arena, assigning one round-robin
+ *            on the first call.
+ */
+static arena_t *get_arena(void)
+{
+    if (thread_arena == NULL)
+    {
+        unsigned int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[i % num_arenas];
+    }
+    return thread_arena;
+}
+
+/*
+ * block_arena: returns the arena a block belongs to.
+ */
+static arena_t *block_arena(block_t *block)
+{
+    return &arenas[mem_region_of(block)];
+}
+
+/*
+ * arena_alloc: allocates a block of asize bytes from the arena, falling back
+ *              to the main heap if the arena is out of memory.
+ */
+static block_t *arena_alloc(arena_t *arena, size_t asize)
+{
+    block_t *block;
+
+    pthread_mutex_lock(&arena->lock);
+    block = alloc_block(arena, asize);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block == NULL && arena != &arenas[0])
+        block = arena_alloc(&arenas[0], asize);
+
+    return block;
+}
+
+/*
+ * meta_alloc: allocates size bytes aligned to alignment bytes, a power of
+ *             two, or to ALIGNMENT if it is 0, for the allocator's own use.
+ *             Like malloc and memalign, but without the tcache, statistics,
+ *             profiling or tracing, so that the memory regions, pools, the
+ *             profiler and the tracer use is not reported as the program's.
+ *             Returns NULL on failure.
+ */
+static void *meta_alloc(size_t alignment, size_t size)
+{
+    arena_t *arena;
+    block_t *block;
+    size_t asize;
+
+    if (!ensure_init() || size == 0 || (asize = adjust_size(size)) == 0 ||
+        alignment > SIZE_MAX/4 || asize > SIZE_MAX/2 - alignment)
+        return NULL;
+
+    if (alignment <= ALIGNMENT)
+    {
+        if (size >= mmap_threshold)
+            return map_block(size);
+        block = arena_alloc(get_arena(), asize);
+        return (block != NULL) ? header_to_payload(block) : NULL;
+    }
+
+    arena = get_arena();
+    pthread_mutex_lock(&arena->lock);
+    block = alloc_aligned(arena, alignment, asize);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (block == NULL && arena != &arenas[0])
+    {
+        pthread_mutex_lock(&arenas[0].lock);
+        block = alloc_aligned(&arenas[0], alignment, asize);
+        pthread_mutex_unlock(&arenas[0].lock);
+    }
+
+    return (block != NULL) ? header_to_payload(block) : NULL;
+}
+
+/*
+ * meta_free: frees a block from meta_alloc, pushing it onto its arena's
+ *            remote queue if that is not the thread's arena.
+ */
+static void meta_free(void *ptr)
+{
+    block_t *block = payload_to_header(ptr);
+    arena_t *arena;
+
+    if (ptr == NULL)
+        return;
+
+    if (get_mmapped(block))
+    {
+        unmap_block(block);
+        return;
+    }
+
+    arena = block_arena(block);
+    if (arena != thread_arena)
+    {
+        remote_push(arena, block, block);
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    free_block(arena, block);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/*
+ * remote_push: hands a chain of blocks, linked from first to last through
+ *              aof.fb.next, to another thread's arena without taking its
+ *              lock. The arena frees them on its next allocation.
+ */
+static void remote_push(arena_t *arena, block_t *first, block_t *last)
+{
+    block_t *head = __atomic_load_n(&arena->remote, __ATOMIC_RELAXED);
+
+    do {
+        last->aof.fb.next = head;
+    } while (!__atomic_compare_exchange_n(&arena->remote, &head, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain: frees every block in the arena's remote queue. The whole
+ *               queue is taken at once, so there is no ABA problem with
+ *               concurrent pushes. Requires the arena's lock.
+ */
+static void remote_drain(arena_t *arena)
+{
+    block_t *block;
+    block_t *next;
+
+    if (__atomic_load_n(&arena->remote, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    block = __atomic_exchange_n(&arena->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = next)
+    {
+        void *bp = header_to_payload(block);
+
+        next = block->aof.fb.next;
+        if (is_slab(bp))
+            slab_free(arena, bp);
+        else
+            free_block(arena, block);
+    }
+}
+
+/*
+ * alloc_block: finds or makes room for a block of asize bytes and marks it
+ *              allocated. Returns NULL if the heap cannot be extended.
+ *              Builds the arena's heap on first use. Requires the arena's lock.
+ */
+static block_t *alloc_block(arena_t *arena, size_t asize)
+{
+    size_t extendsize; // Amount to extend heap if no fit is found
+    bool quiet = arena != &arenas[0]; // Is there a fallback if it fails?
+    block_t *block;
+
+    if (arena->heap_listp == NULL && !init_heap(arena))
+        return NULL;
+
+    /* Blocks freed by other threads may make a fit */
+    remote_drain(arena);
+
+    /* Amortized sweep of the dirty list */
+    if (++arena->ticks % PURGE_TICK == 0 && arena->dirty_tail != NULL)
+        purge_dirty(arena);
+
+    /* Search the segregated lists for a fit */
+    block = find_fit(arena, asize);
+
+    /* If no fit is found, request more memory and then place the block */
+    if (block == NULL)
+    {  
+        extendsize = max(asize, grow_size(arena));
+        dbg_printf("No fit found, extending heap by %zd.\n", extendsize);
+        /* A step that fails is retried smaller, so its failure is no error */
+        block = extend_heap(arena, extendsize,
+                            quiet || extendsize > max(asize, chunksize));
+
+        /* Memory is tight: take a small step, and grow slowly again */
+        if (block == NULL && extendsize > max(asize, chunksize))
+        {
+            arena->grow = chunksize;
+            extendsize = max(asize, chunksize);
+            block = extend_heap(arena, extendsize, quiet);
+        }
+
+        /* Check that extend_heap does not return NULL (error) */
+        if (block == NULL)
+        {
+            dbg_printf("extend_heap(%zd) returned NULL.\n", extendsize);
+            return NULL;
+        }
+    }
+
+    place(arena, block, asize);
+    return block;
+}
+
+/*
+ * alloc_aligned: allocates a block of asize bytes whose payload is aligned
+ *                to alignment bytes, a power of two above ALIGNMENT. Takes a
+ *                block large enough to hold an aligned payload after a free
+ *                block's worth of space, then frees the part before that
+ *                payload and, through resize_block, the part after asize.
+ *                Returns NULL if the heap cannot be extended.
+ *                Requires the arena's lock.
+ */
+static block_t *alloc_aligned(arena_t *arena, size_t alignment, size_t asize)
+{
+    block_t *block = alloc_block(arena, asize + alignment + min_block_size);
+    block_t *block_aligned;
+    uintptr_t bp;
+    size_t lead;  // Bytes before the aligned block
+    size_t csize;
+
+    if (block == NULL)
+        return NULL;
+
+    /* The leading fragment, if any, must be large enough to be a free block */
+    bp = (uintptr_t) header_to_payload(block);
+    lead = round_up(bp, alignment) - bp;
+    if (lead != 0 && lead < min_block_size)
+        lead += alignment;
+
+    if (lead != 0)
+    {
+        dbg_printf("Splitting %zd leading bytes off %p.\n", lead, block);
+        csize = get_size(block);
+        block_aligned = (block_t *)((char *) block + lead);
+        write_header(block_aligned, csize - lead, true, false);
+        write_header(block, lead, false, get_alloc_prev(block));
+        write_footer(block, lead, false);
+        free_block(arena, block);
+        block = block_aligned;
+    }
+
+    /* Give back the tail */
+    resize_block(arena, block, asize);
+    return block;
+}
+
+/*
+ * alloc_batch: allocates up to n blocks of size bytes each from the arena
+ *              into out. Slab objects are taken one by one from the runs.
+ *              Heap blocks are cut out of a single block large enough for
+ *              all of them, found or made by alloc_block, which places it
+ *              and splits off the excess once. Returns the number of blocks
+ *              allocated. Requires the arena's lock.
+ */
+static size_t alloc_batch(arena_t *arena, size_t size, size_t n, void **out)
+{
+    size_t asize;  // Adjusted size of each block
+    size_t csize;  // Size of the block left to cut
+    block_t *block;
+    size_t i;
+
+    if (size <= slab_max_size)
+    {
+        remote_drain(arena);
+        for (i = 0; i < n; i++)
+        {
+            if ((out[i] = slab_take(arena, align(size))) == NULL)
+                break;
+        }
+        return i;
+    }
+
+    asize = adjust_size(size);
+    if (n == 0 || asize == 0 || n > SIZE_MAX / asize)
+        return 0;
+
+    if ((block = alloc_block(arena, n*asize)) == NULL)
+        return 0;
+
+    /*
+     * Every block but the last gets asize bytes; the last keeps the rest.
+     * As in place, the block before the first one is allocated.
+     */
+    csize = get_size(block);
+    for (i = 0; i < n - 1; i++)
+    {
+        write_header(block, asize, true, true);
+        out[i] = header_to_payload(block);
+        block = find_next(block);
+        csize -= asize;
+    }
+    write_header(block, csize, true, true);
+    out[i] = header_to_payload(block);
+
+    return n;
+}
+
+/*
+ * sort_ptrs: sorts pointers by address in place with heapsort, which
+ *            needs no memory of its own (qsort may call malloc).
+ */
+static void sort_ptrs(void **ptrs, size_t n)
+{
+    size_t start = n / 2;
+    size_t end = n;
+    size_t root, child;
+    void *tmp;
+
+    while (end > 1)
+    {
+        /* Build the heap first, then move its maximum to the end */
+        if (start > 0)
+            start--;
+        else
+        {
+            end--;
+            tmp = ptrs[end];
+            ptrs[end] = ptrs[0];
+            ptrs[0] = tmp;
+        }
+
+        /* Sift down the root */
+        for (root = start; (child = 2*root + 1) < end; root = child)
+        {
+            if (child + 1 < end && (uintptr_t) ptrs[child] < (uintptr_t) ptrs[child + 1])
+                child++;
+            if ((uintptr_t) ptrs[root] >= (uintptr_t) ptrs[child])
+                break;
+            tmp = ptrs[root];
+            ptrs[root] = ptrs[child];
+            ptrs[child] = tmp;
+        }
+    }
+}
+
+/*
+ * pool_has_room: returns true if a chunk of the pool has a free object.
+ */
+static bool pool_has_room(mm_pool_t *pool, pool_chunk_t *chunk)
+{
+    return chunk->free != NULL ||
+           chunk->bump + pool->stride <= (char *) chunk + pool->chunk_size;
+}
+
+/*
+ * pool_link: adds a chunk at the front or the back of the pool's list.
+ */
+static void pool_link(mm_pool_t *pool, pool_chunk_t *chunk, bool front)
+{
+    if (front)
+    {
+        chunk->prev = NULL;
+        chunk->next = pool->head;
+        if (pool->head != NULL)
+            pool->head->prev = chunk;
+        else
+            pool->tail = chunk;
+        pool->head = chunk;
+    }
+    else
+    {
+        chunk->next = NULL;
+        chunk->prev = pool->tail;
+        if (pool->tail != NULL)
+            pool->tail->next = chunk;
+        else
+            pool->head = chunk;
+        pool->tail = chunk;
+    }
+}
+
+/*
+ * pool_unlink: removes a chunk from the pool's list.
+ */
+static void pool_unlink(mm_pool_t *pool, pool_chunk_t *chunk)
+{
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        pool->head = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    else
+        pool->tail = chunk->prev;
+}
+
+/*
+ * check_arena: checks one arena for correctness. Walks the heap checking
+ *              the prologue, epilogue, alignment, header/footer agreement,
+ *              the previous-allocated bits and coalescing, then walks the
+ *              segregated lists checking their links and bins, and that
+ *              every free block is on exactly one list.
+ *              Requires the arena's lock.
+ */
+static bool check_arena(arena_t *arena)
+{
+    bool check = true;
+    block_t *ptr;            // Generic block pointer for checking
+    block_t *next_ptr;       // The next block from the current one
+    size_t heap_free = 0;    // Free blocks found walking the heap
+    size_t list_free = 0;    // Free blocks found walking the seglists
+    word_t *prologue = (word_t *) mem_region_lo(arena->id);
+    char *hi = (char *) mem_region_hi(arena->id);
+
+    /*** Checking epilogue and prologue blocks ***/
+    if (extract_size(*prologue) != 0 || !extract_alloc(*prologue))
+        check = false;
+
+    ptr = (block_t *)(hi - (wsize-1)); // Epilogue pointer
+    if (get_size(ptr) != 0 || !get_alloc(ptr))
+        check = false;
+
+    /* Return if error */
+    if (!check)
+        return false;
+
+    /*** Iterating through heap while making multiple checks ***/
+    for (ptr = arena->heap_listp; get_size(ptr) != 0; ptr = next_ptr)
+    {
+        next_ptr = find_next(ptr);
+        if ((char *) next_ptr > hi)
+            return false;
+
+        /* Check alignment and size */
+        if (((size_t) header_to_payload(ptr) % ALIGNMENT) != 0)
+            check = false;
+        if ((get_size(ptr) % ALIGNMENT) != 0 || get_size(ptr) < min_block_size)
+            check = false;
+        /* Check the next block's copy of our allocation status */
+        if (get_alloc_prev(next_ptr) != get_alloc(ptr))
+            check = false;
 
         /* Free blocks */
-        else if (!get_alloc(ptr))
+        if (!get_alloc(ptr))
+        {
+            heap_free++;
+            /* Check coalescing */
+            if (!get_alloc(next_ptr))
+                check = false;
+            /* Check Header+Footer */
+            if (get_size(ptr) != extract_size(*find_prev_footer(next_ptr)))
+                check = false;
+        }
+    }
+
+    /*** Iterating through the segregated lists ***/
+    for (int i = 0; i < SEG_SIZE; i++)
+    {
+        if (i >= TREE_FIRST_LIST)
+        {
+            if (check_tree(arena->seg_listsp[i], NULL, i, &list_free) < 0)
+                check = false;
+        }
+        else for (ptr = arena->seg_listsp[i]; ptr != NULL; ptr = ptr->aof.fb.next)
+        {
+            list_free++;
+            /* Check that the block is free, in this arena and in its bin */
+            if (get_alloc(ptr) || mem_region_of(ptr) != arena->id)
+                return false;
+            if (get_seglist_size(get_size(ptr)) != i)
+                check = false;
+            /* Check links */
+            next_ptr = ptr->aof.fb.next;
+            if (next_ptr != NULL && next_ptr->aof.fb.prev != ptr)
+                check = false;
+            if (list_free > heap_free)
+                return false;
+        }
+        /* Check the list's binmap bit */
+        if ((next_nonempty_list(arena, i) == i) != (arena->seg_listsp[i] != NULL))
+            check = false;
+    }
+
+    if (list_free != heap_free)
+        check = false;
+
+    /*** Iterating through the dirty list, newest first ***/
+    list_free = 0;
+    for (ptr = arena->dirty_head; ptr != NULL; ptr = ptr->aof.tn.dirty_next)
+    {
+        /* Check that the block is a free tree block in this arena */
+        if (++list_free > heap_free || get_alloc(ptr) || mem_region_of(ptr) != arena->id)
+            return false;
+        if (get_seglist_size(get_size(ptr)) < TREE_FIRST_LIST || !get_dirty(ptr))
+            check = false;
+        /* Check links and order */
+        next_ptr = ptr->aof.tn.dirty_next;
+        if (next_ptr == NULL ? arena->dirty_tail != ptr
+                             : (next_ptr->aof.tn.dirty_prev != ptr ||
+                                next_ptr->aof.tn.dirty_since > ptr->aof.tn.dirty_since))
+            check = false;
+    }
+
+    return check;
+}
+
+/*
+ * check_tree: checks the subtree of tree list i rooted at node: parent
+ *             links, (size, address) order, bin of every block, and the
+ *             red-black rules. Adds its number of blocks to *count.
+ *             Returns the subtree's black height, or -1 on error.
+ */
+static long check_tree(block_t *node, block_t *parent, int i, size_t *count)
+{
+    long left, right;
+
+    if (node == NULL)
+        return 0;
+
+    (*count)++;
+    if (get_alloc(node) || node->aof.tn.parent != parent)
+        return -1;
+    if (get_seglist_size(get_size(node)) != i)
+        return -1;
+    if (parent != NULL && (parent->aof.tn.left == node) != tree_less(node, parent))
+        return -1;
+    /* A red node has no red child */
+    if (tree_red(node) && (tree_red(node->aof.tn.left) || tree_red(node->aof.tn.right)))
+        return -1;
+
+    left = check_tree(node->aof.tn.left, node, i, count);
+    right = check_tree(node->aof.tn.right, node, i, count);
+    /* Every path has the same number of black nodes */
+    if (left < 0 || left != right)
+        return -1;
+
+    return left + (tree_red(node) ? 0 : 1);
+}
+
+/*
+ * is_slab: returns true when ptr is a slab object.
+ */
+static bool is_slab(void *ptr)
+{
+    return mem_region_of(ptr) == SLAB_REGION;
+}
+
+/*
+ * slab_run_of: returns the run holding a slab object.
+ */
+static slab_run_t *slab_run_of(void *ptr)
+{
+    return (slab_run_t *)((uintptr_t) ptr & ~((uintptr_t) SLAB_RUN_SIZE - 1));
+}
+
+/*
+ * usable_size: returns the number of bytes usable at an allocated pointer.
+ */
+static size_t usable_size(void *ptr)
+{
+    if (is_slab(ptr))
+        return slab_run_of(ptr)->size;
+    return get_payload_size(payload_to_header(ptr));
+}
+
+/*
+ * slab_fill: takes up to TCACHE_BATCH free objects of the given size from
+ *            the arena's runs into the bin, taking the arena's lock only
+ *            once. Returns the number of objects added.
+ */
+static unsigned int slab_fill(arena_t *arena, tcache_bin_t *bin, size_t size)
+{
+    void *obj;
+    unsigned int n;
+
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    for (n = 0; n < TCACHE_BATCH; n++)
+    {
+        if ((obj = slab_take(arena, size)) == NULL)
+            break;
+        tcache_push(bin, payload_to_header(obj));
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return n;
+}
+
+/*
+ * slab_take: takes a free object of the given size from the arena's runs,
+ *            starting a new run if none has room. Returns NULL if the slab
+ *            region is full. Requires the arena's lock.
+ */
+static void *slab_take(arena_t *arena, size_t size)
+{
+    slab_run_t *run = arena->slab_runs[size/ALIGNMENT - 1];
+
+    if (run == NULL && (run = slab_new_run(arena, size)) == NULL)
+        return NULL;
+
+    /* Take the first free object of the run */
+    int w = 0;
+    while (run->map[w] == ~(word_t) 0)
+        w++;
+    int i = w*BINMAP_BITS + __builtin_ctzll(~run->map[w]);
+    run->map[w] |= (word_t) 1 << (i % BINMAP_BITS);
+
+    /* A full run leaves the list */
+    if (--run->nfree == 0)
+        slab_unlink(arena, run);
+
+    return (char *)(run + 1) + i*size;
+}
+
+/*
+ * slab_free: returns an object to its run. A run that becomes empty is
+ *            made unused, unless it is the only run of its size with free
+ *            objects. Requires the lock of the run's arena.
+ */
+static void slab_free(arena_t *arena, void *ptr)
+{
+    slab_run_t *run = slab_run_of(ptr);
+    int i = ((char *) ptr - (char *)(run + 1)) / run->size;
+
+    run->map[i / BINMAP_BITS] &= ~((word_t) 1 << (i % BINMAP_BITS));
+
+    /* A full run has free objects again */
+    if (run->nfree++ == 0)
+        slab_link(arena, run);
+
+    if (run->nfree == run->nobjs && (run->next != NULL || run->prev != NULL))
+    {
+        dbg_printf("Releasing empty slab run %p.\n", run);
+        slab_unlink(arena, run);
+        run->size = 0;
+        pthread_mutex_lock(&slab_lock);
+        run->next = slab_unused;
+        slab_unused = run;
+        pthread_mutex_unlock(&slab_lock);
+    }
+}
+
+/*
+ * slab_new_run: gives the arena a run of objects of the given size, either
+ *               an unused one or one carved from the slab region, and puts
+ *               it on the arena's list. Returns NULL if the region is full.
+ *               Requires the arena's lock.
+ */
+static slab_run_t *slab_new_run(arena_t *arena, size_t size)
+{
+    slab_run_t *run;
+
+    pthread_mutex_lock(&slab_lock);
+    if ((run = slab_unused) != NULL)
+        slab_unused = run->next;
+    else if ((run = mem_region_try_sbrk(SLAB_REGION, SLAB_RUN_SIZE)) == (void *)-1)
+        run = NULL;
+    pthread_mutex_unlock(&slab_lock);
+
+    if (run == NULL)
+        return NULL;
+
+    dbg_printf("New slab run %p for %zd-byte objects.\n", run, size);
+    run->arena = arena->id;
+    run->size = size;
+    run->nobjs = (SLAB_RUN_SIZE - sizeof(slab_run_t)) / size;
+    run->nfree = run->nobjs;
+    for (int w = 0; w < SLAB_MAP_WORDS; w++)
+        run->map[w] = 0;
+    /* Objects past the end of the run are marked in use for good */
+    for (int i = run->nobjs; i < SLAB_MAP_WORDS*BINMAP_BITS; i++)
+        run->map[i / BINMAP_BITS] |= (word_t) 1 << (i % BINMAP_BITS);
+
+    slab_link(arena, run);
+    return run;
+}
+
+/*
+ * slab_link: adds a run to the front of its arena's list for its size.
+ */
+static void slab_link(arena_t *arena, slab_run_t *run)
+{
+    slab_run_t **runs = &arena->slab_runs[run->size/ALIGNMENT - 1];
+
+    run->prev = NULL;
+    run->next = *runs;
+    if (*runs != NULL)
+        (*runs)->prev = run;
+    *runs = run;
+}
+
+/*
+ * slab_unlink: removes a run from its arena's list for its size.
+ */
+static void slab_unlink(arena_t *arena, slab_run_t *run)
+{
+    if (run->prev != NULL)
+        run->prev->next = run->next;
+    else
+        arena->slab_runs[run->size/ALIGNMENT - 1] = run->next;
+    if (run->next != NULL)
+        run->next->prev = run->prev;
+    run->next = NULL;
+    run->prev = NULL;
+}
+
+/*
+ * check_slabs: checks every run of the slab region: its size, owner, and
+ *              that its free count agrees with its bitmap. Then checks that
+ *              the arenas' lists only hold runs of the right size with
+ *              free objects. Takes every arena's lock in turn.
+ */
+static bool check_slabs(void)
+{
+    bool check = true;
+    char *lo = (char *) mem_region_lo(SLAB_REGION);
+    char *hi = (char *) mem_region_hi(SLAB_REGION);
+    slab_run_t *run;
+    unsigned int used;
+
+    for (unsigned int i = 0; i < num_arenas; i++)
+    {
+        arena_t *arena = &arenas[i];
+
+        pthread_mutex_lock(&arena->lock);
+        for (char *p = lo; p < hi; p += SLAB_RUN_SIZE)
+        {
+            run = (slab_run_t *) p;
+            if (run->size == 0 || run->arena != i)
+                continue;
+            if (run->size % ALIGNMENT != 0 || run->size > slab_max_size)
+                check = false;
+            used = 0;
+            for (int w = 0; w < SLAB_MAP_WORDS; w++)
+                used += __builtin_popcountll(run->map[w]);
+            if (used != SLAB_MAP_WORDS*BINMAP_BITS - run->nfree)
+                check = false;
+        }
+        for (int c = 0; c < SLAB_CLASSES; c++)
+        {
+            for (run = arena->slab_runs[c]; run != NULL; run = run->next)
+            {
+                if (run->size != (unsigned int)(c+1)*ALIGNMENT || run->arena != i || run->nfree == 0)
+                    check = false;
+                if (run->next != NULL && run->next->prev != run)
+                    check = false;
+            }
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    return check;
+}
+
+/*
+ * check_tcache: checks the calling thread's cache: that each bin holds as
+ *               many blocks as it counts, and only slab objects of its size
+ *               or allocated heap blocks of its size or 16 bytes more.
+ */
+static bool check_tcache(void)
+{
+    bool check = true;
+
+    for (int b = 0; b < TCACHE_BINS; b++)
+    {
+        size_t size = (size_t)(b+1) * ALIGNMENT;
+        unsigned int n = 0;
+        block_t *block;
+        void *bp;
+
+        for (block = tcache[b].head; block != NULL && n <= tcache[b].count;
+             block = block->aof.fb.next, n++)
+        {
+            bp = header_to_payload(block);
+            if (is_slab(bp) ? slab_run_of(bp)->size != size :
+                !get_alloc(block) || (get_size(block) != size &&
+                                      get_size(block) != size + ALIGNMENT))
+            {
+                dbg_printf("tcache bin of %zd bytes holds %p.\n", size, bp);
+                check = false;
+            }
+        }
+        if (n != tcache[b].count)
+            check = false;
+    }
+
+    return check;
+}
+
+/*
+ * tcache_bin: returns this thread's cache bin for blocks of size asize.
+ *             Requires asize <= tcache_max_size.
+ */
+static tcache_bin_t *tcache_bin(size_t asize)
+{
+    return &tcache[asize/ALIGNMENT - 1];
+}
+
+/*
+ * tcache_pop: removes and returns the first block of the bin, or NULL if
+ *             the bin is empty.
+ */
+static block_t *tcache_pop(tcache_bin_t *bin)
+{
+    block_t *block = bin->head;
+
+    if (block != NULL)
+    {
+        bin->head = block->aof.fb.next;
+        bin->count--;
+    }
+    return block;
+}
+
+/*
+ * tcache_push: adds an allocated block to the front of the bin.
+ */
+static void tcache_push(tcache_bin_t *bin, block_t *block)
+{
+    block->aof.fb.next = bin->head;
+    bin->head = block;
+    bin->count++;
+}
+
+/*
+ * tcache_refill: fills the bin with blocks of asize bytes from the thread's
+ *                arena, or from the main heap if the arena is exhausted.
+ *                Bins of slab sizes are filled with slab objects instead.
+ */
+static void tcache_refill(tcache_bin_t *bin, size_t asize)
+{
+    arena_t *arena = get_arena();
+
+    tcache_register();
+
+    if (asize <= slab_max_size)
+        slab_fill(arena, bin, asize);
+    else if (tcache_fill(arena, bin, asize) == 0 && arena != &arenas[0])
+        tcache_fill(&arenas[0], bin, asize);
+}
+
+/*
+ * tcache_fill: allocates up to TCACHE_BATCH blocks of asize bytes from the
+ *              segregated lists into the bin, taking the arena's lock only
+ *              once. Returns the number of blocks added.
+ */
+static unsigned int tcache_fill(arena_t *arena, tcache_bin_t *bin, size_t asize)
+{
+    block_t *block;
+    unsigned int n;
+
+    pthread_mutex_lock(&arena->lock);
+    for (n = 0; n < TCACHE_BATCH; n++)
+    {
+        if ((block = alloc_block(arena, asize)) == NULL)
+            break;
+        tcache_push(bin, block);
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    return n;
+}
+
+/*
+ * tcache_flush: returns up to n blocks from the bin to their arenas. Blocks
+ *               of the thread's own arena are freed under its lock, taken
+ *               once. Consecutive blocks of another arena are chained and
+ *               pushed onto its remote queue together.
+ */
+static void tcache_flush(tcache_bin_t *bin, unsigned int n)
+{
+    arena_t *locked = NULL; // Arena whose lock is currently held
+    arena_t *remote = NULL; // Arena of the chain being built
+    block_t *first = NULL;  // Chain of blocks for remote
+    block_t *last = NULL;
+    arena_t *arena;
+    block_t *block;
+
+    while (n-- > 0 && (block = tcache_pop(bin)) != NULL)
+    {
+        void *bp = header_to_payload(block);
+
+        if (is_slab(bp))
+            arena = &arenas[slab_run_of(bp)->arena];
+        else
+            arena = block_arena(block);
+
+        if (arena != thread_arena)
+        {
+            if (arena != remote)
+            {
+                if (remote != NULL)
+                    remote_push(remote, first, last);
+                remote = arena;
+                first = NULL;
+                last = block;
+            }
+            block->aof.fb.next = first;
+            first = block;
+            continue;
+        }
+
+        if (arena != locked)
+        {
+            if (locked != NULL)
+                pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        if (is_slab(bp))
+            slab_free(arena, bp);
+        else
+            free_block(arena, block);
+    }
+
+    if (remote != NULL)
+        remote_push(remote, first, last);
+    if (locked != NULL)
+        pthread_mutex_unlock(&locked->lock);
+}
+
+/*
+ * tcache_register: makes sure tcache_destroy runs when this thread exits.
+ */
+static void tcache_register(void)
+{
+    if (tcache_registered)
+        return;
+
+    pthread_once(&tcache_key_once, tcache_create_key);
+    pthread_setspecific(tcache_key, tcache);
+    tcache_registered = true;
+}
+
+/*
+ * tcache_create_key: creates the key whose destructor flushes a thread's
+ *                    tcache. Run once through pthread_once.
+ */
+static void tcache_create_key(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * tcache_destroy: returns every block cached by an exiting thread to the
+ *                 heap, and retires its statistics counters.
+ */
+static void tcache_destroy(void *arg)
+{
+    tcache_bin_t *bins = (tcache_bin_t *) arg;
+
+    for (int i = 0; i < TCACHE_BINS; i++)
+        tcache_flush(&bins[i], TCACHE_COUNT);
+
+    stats_unregister();
+    trace_unregister();
+
+    /* Later destructors may still malloc; let them re-register */
+    tcache_registered = false;
+}
+
+/*
+ * stats_alloc: counts the allocation of the block at bp.
+ */
+static void stats_alloc(void *bp)
+{
+    stats_register();
+    stats_add(&thread_stats.mallocs, 1);
+    stats_add(&thread_stats.live, usable_size(bp));
+}
+
+/*
+ * stats_free: counts the freeing of the block at ptr, which must not have
+ *             been freed yet.
+ */
+static void stats_free(void *ptr)
+{
+    stats_register();
+    stats_add(&thread_stats.frees, 1);
+    stats_add(&thread_stats.live, -usable_size(ptr));
+}
+
+/*
+ * stats_add: adds n to one of the thread's counters. Only this thread
+ *            writes it, so a plain add suffices, stored atomically for
+ *            mm_get_stats to read.
+ */
+static void stats_add(size_t *counter, size_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_register: links the thread's counters into stats_threads the
+ *                 first time it counts anything, and installs the exit
+ *                 destructor that retires them.
+ */
+static void stats_register(void)
+{
+    if (stats_registered)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    thread_stats.prev = NULL;
+    thread_stats.next = stats_threads;
+    if (stats_threads != NULL)
+        stats_threads->prev = &thread_stats;
+    stats_threads = &thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_registered = true;
+    tcache_register();
+}
+
+/*
+ * stats_unregister: adds an exiting thread's counters to stats_retired and
+ *                   unlinks them.
+ */
+static void stats_unregister(void)
+{
+    if (!stats_registered)
+        return;
+
+    pthread_mutex_lock(&stats_lock);
+    stats_retired.mallocs += thread_stats.mallocs;
+    stats_retired.frees += thread_stats.frees;
+    stats_retired.reallocs += thread_stats.reallocs;
+    stats_retired.live += thread_stats.live;
+    if (thread_stats.prev != NULL)
+        thread_stats.prev->next = thread_stats.next;
+    else
+        stats_threads = thread_stats.next;
+    if (thread_stats.next != NULL)
+        thread_stats.next->prev = thread_stats.prev;
+    pthread_mutex_unlock(&stats_lock);
+
+    thread_stats.mallocs = 0;
+    thread_stats.frees = 0;
+    thread_stats.reallocs = 0;
+    thread_stats.live = 0;
+    stats_registered = false;
+}
+
+/*
+ * stats_reset: zeroes the counters of every thread, for a new heap.
+ */
+static void stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    stats_retired.mallocs = 0;
+    stats_retired.frees = 0;
+    stats_retired.reallocs = 0;
+    stats_retired.live = 0;
+    for (thread_stats_t *ts = stats_threads; ts != NULL; ts = ts->next)
+    {
+        __atomic_store_n(&ts->mallocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ts->frees, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ts->reallocs, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&ts->live, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * tree_stats: adds the free blocks of the tree rooted at node, which is
+ *             segregated list i, to stats.
+ */
+static void tree_stats(block_t *node, int i, mm_stats_t *stats)
+{
+    if (node == NULL)
+        return;
+
+    stats->list_bytes[i] += get_size(node);
+    stats->list_blocks[i]++;
+    stats->largest_free = max(stats->largest_free, get_size(node));
+    tree_stats(node->aof.tn.left, i, stats);
+    tree_stats(node->aof.tn.right, i, stats);
+}
+
+/*
+ * prof_sample: called when the thread's countdown to the next sample has
+ *              run out. Draws the next countdown, and returns true if the
+ *              current request should be sampled: not when the profiler
+ *              is running, nor on the thread's first draw, since the
+ *              countdown was not running yet.
+ */
+static bool prof_sample(void)
+{
+    bool first = (prof_seed == 0);
+
+    if (prof_busy)
+        return false;
+
+    prof_countdown = prof_next(__atomic_load_n(&prof_rate, __ATOMIC_RELAXED));
+    return !first;
+}
+
+/*
+ * prof_malloc: allocates a sampled block of size bytes from the heap or a
+ *              mapping, never from the slabs or the tcache, so that it has
+ *              a header. Records the caller's stack in prof_table and sets
+ *              the block's sampled bit. Returns NULL on failure.
+ *              Not inlined, so that it is the one frame skipped; pprof
+ *              drops the malloc, calloc and realloc frames above it.
+ */
+static void *prof_malloc(size_t size)
+{
+    void *stack[PROF_MAX_DEPTH + PROF_SKIP];
+    prof_sample_t **bucket;
+    prof_sample_t *sample;
+    block_t *block;
+    void *bp;
+    int depth;
+
+    /* backtrace may allocate the first time it is called */
+    prof_busy = true;
+    depth = backtrace(stack, PROF_MAX_DEPTH + PROF_SKIP) - PROF_SKIP;
+
+    if (size >= mmap_threshold)
+        bp = map_block(size);
+    else
+    {
+        block = arena_alloc(get_arena(), adjust_size(size));
+        bp = (block != NULL) ? header_to_payload(block) : NULL;
+    }
+
+    if (bp == NULL)
+    {
+        prof_busy = false;
+        return NULL;
+    }
+    stats_alloc(bp);
+
+    pthread_mutex_lock(&prof_lock);
+    if (prof_table == NULL)
+    {
+        prof_table = meta_alloc(0, PROF_BUCKETS * sizeof(prof_sample_t *));
+        if (prof_table != NULL)
+            memset(prof_table, 0, PROF_BUCKETS * sizeof(prof_sample_t *));
+        prof_pool = mm_pool_create(sizeof(prof_sample_t), 0);
+    }
+
+    if (prof_table != NULL && prof_pool != NULL &&
+        (sample = mm_pool_alloc(prof_pool)) != NULL)
+    {
+        dbg_printf("Sampled %p of %zd bytes.\n", bp, size);
+        sample->ptr = bp;
+        sample->size = size;
+        sample->depth = max(depth, 0);
+        memcpy(sample->stack, stack + PROF_SKIP, sample->depth * sizeof(void *));
+        bucket = prof_bucket(bp);
+        sample->next = *bucket;
+        *bucket = sample;
+        set_sampled(payload_to_header(bp), true);
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    prof_busy = false;
+    return bp;
+}
+
+/*
+ * prof_free: drops the sample of a sampled block about to be freed, and
+ *            clears its sampled bit. Must not be called under an arena lock.
+ */
+static void prof_free(void *ptr)
+{
+    prof_sample_t **link;
+    prof_sample_t *sample;
+
+    prof_busy = true;
+    pthread_mutex_lock(&prof_lock);
+    for (link = prof_bucket(ptr); (sample = *link) != NULL; link = &sample->next)
+    {
+        if (sample->ptr == ptr)
         {
-            next_ptr = find_next(ptr);
-            word_t *footerp = find_prev_footer(next_ptr); // Block footer
-            /* Check coalescing */
-            if (!get_alloc(next_ptr))
-                check = false;
-            /* Check alignment */
-            if (((size_t)ptr % dsize) != 0)
-                check = false;
-            /* Check Header+Footer */
-            if (get_alloc_prev(next_ptr))
-                check = false;
-            if (get_size(ptr) != extract_size(*footerp))
-                check = false;
+            *link = sample->next;
+            mm_pool_free(prof_pool, sample);
+            break;
         }
+    }
+    set_sampled(payload_to_header(ptr), false);
+    pthread_mutex_unlock(&prof_lock);
+    prof_busy = false;
+}
+
+/*
+ * prof_next: returns the number of bytes to allocate before the next
+ *            sample, drawn from an exponential distribution of mean rate
+ *            as -ln(U) * rate for a uniform U in (0, 1]. U is 26 random
+ *            bits from a per-thread xorshift generator, and its log2 is
+ *            approximated with a quadratic between powers of two, which is
+ *            plenty for sampling and needs no libm.
+ */
+static intptr_t prof_next(size_t rate)
+{
+    uint64_t r;
+    int k;
+    double m;
+    double next;
+
+    if (prof_seed == 0)
+        prof_seed = ((uintptr_t) &prof_seed ^ (now_ms() << 24)) | 1;
+
+    prof_seed ^= prof_seed >> 12;
+    prof_seed ^= prof_seed << 25;
+    prof_seed ^= prof_seed >> 27;
+    r = ((prof_seed * 2685821657736338717ULL) >> 38) + 1; // In [1, 2^26]
+
+    /* log2(r) = k + log2(1 + m), with log2(1 + m) ~ m * (1.3466 - 0.3466m) */
+    k = 63 - __builtin_clzll(r);
+    m = (double) r / ((uint64_t) 1 << k) - 1.0;
+    next = (26 - k - m * (1.3466 - 0.3466 * m)) * 0.6931471805599453 * rate;
+
+    if (next >= (double) INTPTR_MAX)
+        return INTPTR_MAX;
+    return (intptr_t) next + 1;
+}
+
+/*
+ * prof_bucket: returns the prof_table bucket for a payload address.
+ */
+static prof_sample_t **prof_bucket(void *ptr)
+{
+    uint64_t h = ((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+    return &prof_table[h >> (64 - __builtin_ctz(PROF_BUCKETS))];
+}
+
+/*
+ * prof_stack_bucket: returns the prof_stacks bucket for a sample's stack.
+ */
+static prof_sample_t **prof_stack_bucket(prof_sample_t *sample)
+{
+    uint64_t h = (uint64_t) sample->depth;
+
+    for (int i = 0; i < sample->depth; i++)
+        h = (h ^ (uintptr_t) sample->stack[i]) * 0x9E3779B97F4A7C15ULL;
+    return &prof_stacks[h >> (64 - __builtin_ctz(PROF_BUCKETS))];
+}
+
+/*
+ * prof_printf: formats into the dump's buffer, flushing it when full.
+ */
+static void prof_printf(prof_out_t *out, const char *fmt, ...)
+{
+    va_list args;
+    int n;
 
-        ptr = find_next(ptr); // Next block in heap
+    for (int tries = 0; tries < 2; tries++)
+    {
+        va_start(args, fmt);
+        n = vsnprintf(out->buf + out->len, sizeof(out->buf) - out->len, fmt, args);
+        va_end(args);
+        if (n >= 0 && (size_t) n < sizeof(out->buf) - out->len)
+        {
+            out->len += n;
+            return;
+        }
+        prof_flush(out);
     }
+    out->ok = false;
+}
 
-    if (!check)
-        dbg_printf("Failed mm_checkheap at lineno: %d", lineno);
+/*
+ * prof_flush: writes out the dump's buffer.
+ */
+static void prof_flush(prof_out_t *out)
+{
+    size_t done = 0;
+    ssize_t n;
 
-    return check;
+    while (done < out->len)
+    {
+        if ((n = write(out->fd, out->buf + done, out->len - done)) <= 0)
+        {
+            out->ok = false;
+            break;
+        }
+        done += n;
+    }
+    out->len = 0;
 }
 
+/*
+ * trace_active: returns true when the current call should be recorded: a
+ *               trace is on, and this is not a call made by the allocator
+ *               itself while handling a recorded one.
+ */
+static bool trace_active(void)
+{
+    return __atomic_load_n(&trace_on, __ATOMIC_RELAXED) && !trace_busy;
+}
 
-/******** The remaining functions below are helper and debug routines ********/
+/*
+ * trace_malloc, trace_calloc, trace_realloc, trace_memalign, trace_free:
+ *               make the call with tracing suspended, and record it. An
+ *               allocation is stamped after it returns, and a free before
+ *               it starts, so a reused address is always freed before it
+ *               is allocated again in the trace.
+ */
+static void *trace_malloc(size_t size)
+{
+    void *bp;
+
+    trace_busy = true;
+    bp = malloc(size);
+    trace_record(MM_TRACE_MALLOC, (uintptr_t) bp, size, 0, now_ns());
+    trace_busy = false;
+    return bp;
+}
+
+static void *trace_calloc(size_t nmemb, size_t size)
+{
+    void *bp;
+
+    trace_busy = true;
+    bp = calloc(nmemb, size);
+    trace_record(MM_TRACE_CALLOC, (uintptr_t) bp, nmemb * size, 0, now_ns());
+    trace_busy = false;
+    return bp;
+}
+
+static void *trace_realloc(void *oldptr, size_t size)
+{
+    word_t start = now_ns();
+    uintptr_t old = (uintptr_t) oldptr; // Only an id once realloc returns
+    void *newptr;
+
+    trace_busy = true;
+    newptr = realloc(oldptr, size);
+    /* The two halves are consecutive in the thread's ring */
+    trace_record(MM_TRACE_REALLOC_FROM, old, 0, 0, start);
+    trace_record(MM_TRACE_REALLOC, (uintptr_t) newptr, size, 0, now_ns());
+    trace_busy = false;
+    return newptr;
+}
+
+static void *trace_memalign(size_t alignment, size_t size)
+{
+    void *bp;
+
+    trace_busy = true;
+    bp = memalign(alignment, size);
+    trace_record(MM_TRACE_MEMALIGN, (uintptr_t) bp, size,
+                 (alignment != 0) ? __builtin_ctzll(alignment) : 0, now_ns());
+    trace_busy = false;
+    return bp;
+}
+
+static void trace_free(void *ptr, size_t size, bool sized)
+{
+    trace_busy = true;
+    if (ptr != NULL)
+        trace_record(MM_TRACE_FREE, (uintptr_t) ptr, size, 0, now_ns());
+    if (sized)
+        free_sized(ptr, size);
+    else
+        free(ptr);
+    trace_busy = false;
+}
+
+/*
+ * trace_record: appends an event to the thread's ring, first taking a ring
+ *               if the thread has none: a free one, claimed by setting its
+ *               owned flag, or a new one, mapped outside the heap and
+ *               pushed onto trace_rings with a compare-and-swap. Neither
+ *               takes trace_lock, which the writer may hold; instead,
+ *               trace_claiming keeps mm_trace_stop from unmapping rings
+ *               while they are searched. The event is dropped if the ring is full,
+ *               so recording never waits for the writer. Requires
+ *               trace_busy.
+ */
+static void trace_record(uint8_t op, uintptr_t ptr, size_t size,
+                         uint8_t align_log2, word_t time)
+{
+    trace_ring_t *ring = trace_ring;
+    mm_trace_event_t *event;
+    size_t head;
+
+    if (ring == NULL)
+    {
+        /* mm_trace_stop unmaps free rings once no thread is looking */
+        __atomic_add_fetch(&trace_claiming, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&trace_on, __ATOMIC_SEQ_CST))
+        {
+            __atomic_sub_fetch(&trace_claiming, 1, __ATOMIC_RELEASE);
+            return;
+        }
+        for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL;
+             ring = ring->next)
+        {
+            if (!__atomic_load_n(&ring->owned, __ATOMIC_RELAXED) &&
+                !__atomic_exchange_n(&ring->owned, true, __ATOMIC_ACQUIRE))
+                break;
+        }
+        if (ring == NULL && (ring = mem_map_meta(sizeof(trace_ring_t))) != NULL)
+        {
+            ring->owned = true;
+            ring->head = 0;
+            ring->tail = 0;
+            ring->dropped = 0;
+            ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring,
+                                                true, __ATOMIC_RELEASE,
+                                                __ATOMIC_RELAXED))
+                ;
+        }
+        __atomic_sub_fetch(&trace_claiming, 1, __ATOMIC_RELEASE);
+
+        if ((trace_ring = ring) == NULL)
+            return;
+        ring->thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+        tcache_register();
+    }
+
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    event = &ring->events[head % TRACE_RING_EVENTS];
+    event->time = time - trace_epoch;
+    event->ptr = ptr;
+    event->size = size;
+    event->thread = ring->thread;
+    event->op = op;
+    event->align_log2 = align_log2;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * trace_unregister: gives an exiting thread's ring back for reuse. Events
+ *                   still in it are written out as usual.
+ */
+static void trace_unregister(void)
+{
+    if (trace_ring == NULL)
+        return;
+
+    __atomic_store_n(&trace_ring->owned, false, __ATOMIC_RELEASE);
+    trace_ring = NULL;
+}
+
+/*
+ * trace_write: body of the writer thread. Drains the rings every
+ *              TRACE_FLUSH_US microseconds, and once more when told to
+ *              stop.
+ */
+static void *trace_write(void *arg)
+{
+    struct timespec period = { 0, TRACE_FLUSH_US * 1000 };
+
+    (void) arg;
+    trace_busy = true;
+    while (!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE))
+    {
+        if (trace_drain() == 0)
+            nanosleep(&period, NULL);
+    }
+    trace_drain();
+    return NULL;
+}
+
+/*
+ * trace_drain: writes the events recorded in every ring since the last
+ *              drain to trace_fd, retrying short and interrupted writes so
+ *              that no event is split. Rings are only ever added to the
+ *              front of trace_rings, so no lock is needed to walk them.
+ *              Returns the number of events written.
+ */
+static size_t trace_drain(void)
+{
+    trace_ring_t *ring;
+    size_t written = 0;
+    size_t tail, head, n;
+    size_t done, len;
+    char *buf;
+    ssize_t w;
+
+    for (ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next)
+    {
+        tail = ring->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while (tail != head)
+        {
+            /* Up to the end of the ring, then from its start */
+            n = min(head - tail, TRACE_RING_EVENTS - tail % TRACE_RING_EVENTS);
+            buf = (char *) &ring->events[tail % TRACE_RING_EVENTS];
+            len = n * sizeof(mm_trace_event_t);
+            for (done = 0; done < len; done += w)
+            {
+                if ((w = write(trace_fd, buf + done, len - done)) < 0 &&
+                    errno == EINTR)
+                    w = 0;
+                else if (w <= 0)
+                    break;
+            }
+            if (done < len)
+            {
+                /* Give up on what is left rather than block the threads */
+                tail = head;
+                break;
+            }
+            tail += n;
+            written += n;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return written;
+}
+
+/*
+ * now_ns: returns the current monotonic time in nanoseconds.
+ */
+static word_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (word_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
 
 /*
  * insert_list: insert the block into the free list by moving pointers 
  *              around. Using LIFO ordering for insertion.
  */
-static void insert_list(block_t *block)
+static void insert_list(arena_t *arena, block_t *block)
 {
     dbg_printf("Inserting block %p into free list.\n", block);
 
     /* Find which seglist to insert the block into based on its size */
     int i = get_seglist_size(get_size(block));
 
+    /* Large blocks go into the list's tree, clean */
+    if (i >= TREE_FIRST_LIST)
+    {
+        block->aof.tn.dirty_since = 0;
+        tree_insert(&arena->seg_listsp[i], block);
+        arena->binmap[i / BINMAP_BITS] |= (word_t) 1 << (i % BINMAP_BITS);
+        return;
+    }
+
     /* Set pointer to previous block to NULL */
     block->aof.fb.prev = NULL;
 
     /* Add block to the front of an empty/uninitialized seglist[i] */
-    if (seg_listsp[i] == NULL)
+    if (arena->seg_listsp[i] == NULL)
     {
         block->aof.fb.next = NULL;
-        seg_listsp[i] = block;
+        arena->seg_listsp[i] = block;
+        arena->binmap[i / BINMAP_BITS] |= (word_t) 1 << (i % BINMAP_BITS);
         dbg_printf("Inserted into empty list.\n");
     }
 
     /* Add block to the front of a non-empty seglist[i] */
     else
     {
-        seg_listsp[i]->aof.fb.prev = block;
-        block->aof.fb.next = seg_listsp[i];
-        seg_listsp[i] = block;
+        arena->seg_listsp[i]->aof.fb.prev = block;
+        block->aof.fb.next = arena->seg_listsp[i];
+        arena->seg_listsp[i] = block;
         dbg_printf("Inserted into non-empty list.\n");
     }
 
-    dbg_printf("free_listp = %p\n", free_listp);
+    dbg_printf("seg_listsp[%d] = %p\n", i, arena->seg_listsp[i]);
 }
 
 
 /*
  * remove_list: remove the block from the free list by moving pointers around 
  */
-static void remove_list(block_t *block)
+static void remove_list(arena_t *arena, block_t *block)
 {    
     dbg_printf("Removing block %p from free list.\n", block);
     
     /* Find which seglist to insert the block into based on its size */
     int i = get_seglist_size(get_size(block));
 
+    /* Large blocks are removed from the list's tree and the dirty list */
+    if (i >= TREE_FIRST_LIST)
+    {
+        if (block->aof.tn.dirty_since != 0)
+            dirty_remove(arena, block);
+        tree_remove(&arena->seg_listsp[i], block);
+        if (arena->seg_listsp[i] == NULL)
+            arena->binmap[i / BINMAP_BITS] &= ~((word_t) 1 << (i % BINMAP_BITS));
+        return;
+    }
+
     /* Check if block is the first element ("head") of the list */
     if (block->aof.fb.prev == NULL)
-        seg_listsp[i] = block->aof.fb.next;
+    {
+        arena->seg_listsp[i] = block->aof.fb.next;
+        /* Clear the binmap bit if the list is now empty */
+        if (arena->seg_listsp[i] == NULL)
+            arena->binmap[i / BINMAP_BITS] &= ~((word_t) 1 << (i % BINMAP_BITS));
+    }
 
     /* Check if block is not the last element of the list */
     if (block->aof.fb.next != NULL)
@@ -574,16 +3794,22 @@ static void remove_list(block_t *block)
  * extend_heap: Extends the heap with the requested number of bytes, and
  *              recreates epilogue header. Returns a pointer to the result of
  *              coalescing the newly-created block with previous free block, if
- *              applicable, or NULL in failure.
+ *              applicable, or NULL in failure. memlib reports the failure
+ *              unless quiet is set, for callers that can fall back.
  */
-static block_t *extend_heap(size_t asize) 
+static block_t *extend_heap(arena_t *arena, size_t asize, bool quiet) 
 {
     dbg_printf("Called extend_heap(%zd)\n", asize);
 
-    void *bp; // Pointer to start of new heap memory
+    void *bp;   // Pointer to start of new heap memory
+    bool dirty; // Is the free block before the new space dirty?
 
-    if ((bp = mem_sbrk(asize)) == (void *)-1)
+    bp = quiet ? mem_region_try_sbrk(arena->id, asize)
+               : mem_region_sbrk(arena->id, asize);
+    if (bp == (void *)-1)
         return NULL;
+    arena->extends++;
+    prefault_kick(arena);
         
     /* Initialize new free block's header and footer */
     block_t *block = payload_to_header(bp);
@@ -596,8 +3822,95 @@ static block_t *extend_heap(size_t asize)
     
     dbg_printf("extend_heap() successful.\n");
 
-    /* Coalesce in case the previous block was free */
-    return coalesce(block);
+    /* Coalesce in case the previous block was free; its pages still need purging */
+    dirty = !get_alloc_prev(block) && get_dirty(find_prev(block));
+    block = coalesce(arena, block);
+    if (dirty)
+        dirty_insert(arena, block);
+    return block;
+}
+
+/*
+ * grow_size: returns the arena's growth step for an extension about to be
+ *            made, and records the time. The step doubles if the previous
+ *            extension was less than GROW_WINDOW_MS ago, up to grow_max, and
+ *            halves otherwise. The driver counts time in the arena's
+ *            allocations instead, so that its runs are repeatable.
+ *            Requires the arena's lock.
+ */
+static size_t grow_size(arena_t *arena)
+{
+    size_t limit = __atomic_load_n(&grow_max, __ATOMIC_RELAXED);
+#ifdef DRIVER
+    word_t now = arena->ticks;
+    word_t window = GROW_WINDOW_TICKS;
+#else
+    word_t now = now_ms();
+    word_t window = GROW_WINDOW_MS;
+#endif
+
+    if (now - arena->grow_time < window)
+        arena->grow = min(2 * arena->grow, limit);
+    else
+        arena->grow = max(arena->grow / 2, chunksize);
+    arena->grow = min(arena->grow, max(limit, chunksize));
+    arena->grow_time = now;
+
+    return arena->grow;
+}
+
+/*
+ * prefault_kick: wakes prefault_run for the arena if its break has come
+ *                within half of prefault_ahead of the end of the memory
+ *                faulted in for it. Called with the arena's lock held.
+ */
+static void prefault_kick(arena_t *arena)
+{
+    size_t ahead = __atomic_load_n(&prefault_ahead, __ATOMIC_RELAXED);
+    uintptr_t brk = (uintptr_t) mem_region_hi(arena->id) + 1;
+
+    if (ahead == 0 ||
+        brk + ahead/2 <= __atomic_load_n(&prefault_end[arena->id], __ATOMIC_RELAXED))
+        return;
+
+    pthread_mutex_lock(&prefault_lock);
+    prefault_pending |= 1u << arena->id;
+    pthread_cond_signal(&prefault_cond);
+    pthread_mutex_unlock(&prefault_lock);
+}
+
+/*
+ * prefault_run: body of the background prefault thread. Faults in
+ *               prefault_ahead bytes past the break of each arena it is
+ *               woken for, without holding any of the allocator's locks.
+ */
+static void *prefault_run(void *arg)
+{
+    unsigned int pending;
+
+    (void) arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&prefault_lock);
+        while (prefault_pending == 0)
+            pthread_cond_wait(&prefault_cond, &prefault_lock);
+        pending = prefault_pending;
+        prefault_pending = 0;
+        pthread_mutex_unlock(&prefault_lock);
+
+        for (unsigned int i = 0; i < MAX_ARENAS; i++)
+        {
+            size_t ahead = __atomic_load_n(&prefault_ahead, __ATOMIC_RELAXED);
+            uintptr_t brk = (uintptr_t) mem_region_hi(i) + 1;
+
+            if ((pending & (1u << i)) == 0 || ahead == 0)
+                continue;
+            if (mem_region_prefault(i, ahead))
+                __atomic_store_n(&prefault_end[i], brk + ahead, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
 }
 
 /* coalesce: Coalesces current block with previous and next blocks if
@@ -606,7 +3919,7 @@ static block_t *extend_heap(size_t asize)
  *           Returns pointer to the coalesced block. After coalescing, the
  *           immediate contiguous previous and next blocks must be allocated.
  */
-static block_t *coalesce(block_t *block) 
+static block_t *coalesce(arena_t *arena, block_t *block) 
 {
     block_t *block_next = find_next(block);
 
@@ -621,20 +3934,20 @@ static block_t *coalesce(block_t *block)
         write_header(block, size, false, true);
         write_footer(block, size, false);
         /* Insert the updated block into the list */
-        insert_list(block);
+        insert_list(arena, block);
     }
 
     else if (prev_alloc && !next_alloc)        // Case 2
     {
         dbg_printf("coalesce: Case 2\n");
         /* Remove the next block from the free list */
-        remove_list(block_next);
+        remove_list(arena, block_next);
         /* Update current block with the size of the next block */
         size += get_size(block_next);
         write_header(block, size, false, true);
         write_footer(block, size, false);
         /* Insert the updated block into the list */
-        insert_list(block);
+        insert_list(arena, block);
     }
 
     else if (!prev_alloc && next_alloc)        // Case 3
@@ -643,13 +3956,13 @@ static block_t *coalesce(block_t *block)
         /* Previous block is free, so can use its footer to get its header */
         block_t *block_prev = find_prev(block);
         /* Remove previous block from the seglist to add again later */
-        remove_list(block_prev);
+        remove_list(arena, block_prev);
         /* Update size and write header & footer of previous block */
         size += get_size(block_prev);
         write_header(block_prev, size, false, get_alloc_prev(block_prev));
         write_footer(block_prev, size, false);
         /* Re-insert updated block_prev into seglist */
-        insert_list(block_prev);
+        insert_list(arena, block_prev);
         /* Make returned block the previous block */
         block = block_prev;
     }
@@ -660,27 +3973,186 @@ static block_t *coalesce(block_t *block)
         /* Previous block is free, so can use its footer to get its header */
         block_t *block_prev = find_prev(block);
         /* Remove next & previous blocks from their seg lists */
-        remove_list(block_next);
-        remove_list(block_prev);
+        remove_list(arena, block_next);
+        remove_list(arena, block_prev);
         /* Update size and headers of the previous block */
         size += get_size(block_next) + get_size(block_prev);
         write_header(block_prev, size, false, get_alloc_prev(block_prev));
         write_footer(block_prev, size, false);
         /* Re-insert updated block_prev into seglist */
-        insert_list(block_prev);
+        insert_list(arena, block_prev);
         /* Make returned block the previous block */
         block = block_prev;
     }
 
     /* Set previous block allocation flag of new next block to false */
-    block_next = find_next(block);
-    next_alloc = get_alloc(block_next); 
-    size = get_size(block_next);
-    write_header(block_next, size, next_alloc, false);
+    set_alloc_prev(find_next(block), false);
 
     return block;
 }
 
+/*
+ * free_block: frees an allocated block, coalescing it with its neighbours.
+ *             If the coalesced block ends the heap and is at least
+ *             trim_threshold bytes, all of it but a pad of the growth step
+ *             is trimmed off the heap. Then, if what is left is at least
+ *             purge_threshold bytes, the pages of the freed block and of
+ *             neighbours not purged yet are purged.
+ *             Requires the arena's lock.
+ */
+static void free_block(arena_t *arena, block_t *block)
+{
+    block_t *block_next = find_next(block);
+    char *lo = (char *) block;       // Span that may hold resident pages
+    char *hi = (char *) block_next;
+    size_t pad = max(arena->grow, chunksize); // Free bytes kept by a trim
+    size_t size;
+
+    if (!get_alloc_prev(block) && !get_purged(find_prev(block)))
+        lo = (char *) find_prev(block);
+    if (!get_alloc(block_next) && !get_purged(block_next))
+        hi += get_size(block_next);
+
+    /* Coalesce removes the block from its seglist and coalesces */
+    block = coalesce(arena, block);
+    size = get_size(block);
+
+    if (size >= __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED) &&
+        size >= pad + chunksize && get_size(find_next(block)) == 0)
+    {
+        dbg_printf("Trimming %zd bytes off arena %u.\n", size - pad, arena->id);
+        arena->grow = max(arena->grow / 2, chunksize);
+        /* Keep the pad free for the next extension; a new epilogue follows */
+        remove_list(arena, block);
+        write_header(block, pad, false, get_alloc_prev(block));
+        write_footer(block, pad, false);
+        write_header(find_next(block), 0, true, false);
+        insert_list(arena, block);
+        mem_region_trim(arena->id, size - pad);
+        /* The pad's pages stay resident; only what follows was released */
+        size = pad;
+        if (hi > (char *) block + pad)
+            hi = (char *) block + pad;
+    }
+
+    if (size >= __atomic_load_n(&purge_threshold, __ATOMIC_RELAXED))
+    {
+        /* Purge now, or leave it to purge_dirty */
+        if (__atomic_load_n(&purge_decay, __ATOMIC_RELAXED) == 0)
+            purge_block(block, lo, hi);
+        else
+            dirty_insert(arena, block);
+    }
+}
+
+/*
+ * purge_block: gives the pages of [lo, hi), widened to whole pages, back to
+ *              the system, keeping those of the free tree block's links and
+ *              footer.
+ */
+static void purge_block(block_t *block, char *lo, char *hi)
+{
+    size_t page = mem_pagesize();
+    uintptr_t start = (uintptr_t) &block->aof + sizeof(tree_t); // Past the links
+    uintptr_t end = (uintptr_t) block + get_size(block) - wsize; // The footer
+
+    start = max(start, (uintptr_t) lo & ~(page - 1));
+    end = min(end, round_up((uintptr_t) hi, page));
+    dbg_printf("Purging %zd bytes of free block %p.\n", end - start, block);
+    if (start < end)
+        mem_purge((void *) start, end - start);
+}
+
+/*
+ * purge_dirty: purges up to PURGE_BATCH blocks that have been on the
+ *              arena's dirty list for purge_decay milliseconds or more,
+ *              oldest first. Requires the arena's lock.
+ */
+static void purge_dirty(arena_t *arena)
+{
+    word_t now = now_ms();
+    word_t decay = __atomic_load_n(&purge_decay, __ATOMIC_RELAXED);
+    block_t *block;
+
+    for (int n = 0; n < PURGE_BATCH && (block = arena->dirty_tail) != NULL; n++)
+    {
+        if (now - block->aof.tn.dirty_since < decay)
+            break;
+        dirty_remove(arena, block);
+        purge_block(block, (char *) block, (char *) find_next(block));
+    }
+}
+
+/*
+ * get_dirty: returns true when a free block is on its arena's dirty list.
+ */
+static bool get_dirty(block_t *block)
+{
+    return get_seglist_size(get_size(block)) >= TREE_FIRST_LIST &&
+           block->aof.tn.dirty_since != 0;
+}
+
+/*
+ * get_purged: returns true when a free block's pages have been purged: it
+ *             is at least purge_threshold bytes and not waiting on the dirty
+ *             list. Space new from extend_heap counts as purged.
+ */
+static bool get_purged(block_t *block)
+{
+    return get_size(block) >= __atomic_load_n(&purge_threshold, __ATOMIC_RELAXED) &&
+           !get_dirty(block);
+}
+
+/*
+ * dirty_insert: stamps a free tree block with the current time and adds
+ *               it to the front (newest end) of the arena's dirty list.
+ */
+static void dirty_insert(arena_t *arena, block_t *block)
+{
+    block->aof.tn.dirty_since = now_ms();
+    block->aof.tn.dirty_prev = NULL;
+    block->aof.tn.dirty_next = arena->dirty_head;
+
+    if (arena->dirty_head != NULL)
+        arena->dirty_head->aof.tn.dirty_prev = block;
+    else
+        arena->dirty_tail = block;
+    arena->dirty_head = block;
+}
+
+/*
+ * dirty_remove: removes a block from the arena's dirty list, leaving it
+ *               clean.
+ */
+static void dirty_remove(arena_t *arena, block_t *block)
+{
+    block_t *next = block->aof.tn.dirty_next;
+    block_t *prev = block->aof.tn.dirty_prev;
+
+    if (prev != NULL)
+        prev->aof.tn.dirty_next = next;
+    else
+        arena->dirty_head = next;
+
+    if (next != NULL)
+        next->aof.tn.dirty_prev = prev;
+    else
+        arena->dirty_tail = prev;
+
+    block->aof.tn.dirty_since = 0;
+}
+
+/*
+ * now_ms: returns a monotonic time in milliseconds, never 0.
+ */
+static word_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (word_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
 /*
  * place: Places block with size of asize at the start of bp. If the remaining
  *        size is at least the minimum block size, then split the block to the
@@ -688,13 +4160,14 @@ static block_t *coalesce(block_t *block)
  *        inserted into the explicit (segregated, hopefully, soon) list. 
  *        Requires that the block is initially unallocated.
  */
-static void place(block_t *block, size_t asize)
+static void place(arena_t *arena, block_t *block, size_t asize)
 {
     block_t *block_next;
     size_t csize = get_size(block);   // Current block size
+    bool dirty = get_dirty(block);    // Is the block waiting to be purged?
 
     /* Block must be removed as it is still in its free list */
-    remove_list(block);
+    remove_list(arena, block);
 
     /* Splitting case */
     if ((csize - asize) >= min_block_size)
@@ -705,10 +4178,6 @@ static void place(block_t *block, size_t asize)
          * minimum block size 
          */
 
-        block_t *block_next_next; // The block after the new free block
-        size_t next_next_size;
-        bool next_next_alloc;
-
         /* 
          * Set block to allocated. We know the previous block is never free 
          * because of coalescing so we set the final paramater to "true".
@@ -723,13 +4192,13 @@ static void place(block_t *block, size_t asize)
         write_footer(block_next, csize-asize, false); // Free block *does* have a footer
         /* Insert the new splitted block into the free list */
         dbg_printf("Splitting occured: placing block_next in free list.\n");
-        insert_list(block_next);
+        insert_list(arena, block_next);
+        /* The remainder still needs purging */
+        if (dirty && get_seglist_size(csize-asize) >= TREE_FIRST_LIST)
+            dirty_insert(arena, block_next);
 
         /* Write to the previous allocation flag of the new free block's next block */
-        block_next_next = find_next(block_next);
-        next_next_size = get_size(block_next_next);
-        next_next_alloc = get_alloc(block_next_next);
-        write_header(block_next_next, next_next_size, next_next_alloc, false);
+        set_alloc_prev(find_next(block_next), false);
 
         dbg_printf("Placement successful.\n");
     }
@@ -737,83 +4206,448 @@ static void place(block_t *block, size_t asize)
     /* No splitting */
     else
     { 
-        size_t next_size;
-        bool next_alloc;
-
         /* Update header values (same details apply as previous case) */
         write_header(block, csize, true, true);
 
         /* Write to the previous allocation flag of the next block */
+        set_alloc_prev(find_next(block), true);
+    }
+}
+
+/*
+ * resize_block: resizes an allocated block to asize bytes without moving
+ *               it. To grow, the block absorbs the free block after it; at
+ *               the end of the heap, the heap is extended by just what is
+ *               missing. Any excess of at least min_block_size bytes is
+ *               split off the tail and freed. Returns false, leaving the
+ *               block untouched, if there is no room to grow.
+ *               Requires the arena's lock.
+ */
+static bool resize_block(arena_t *arena, block_t *block, size_t asize)
+{
+    size_t csize = get_size(block);        // Current block size
+    block_t *block_next = find_next(block);
+    block_t *block_tail;                   // Block after the free neighbour
+    size_t next_size = 0;
+
+    if (asize > csize)
+    {
+        /* Room right after the block: a free neighbour, the heap's end, or both */
+        if (!get_alloc(block_next))
+            next_size = get_size(block_next);
+
+        if (csize + next_size < asize)
+        {
+            block_tail = (next_size == 0) ? block_next : find_next(block_next);
+            if (get_size(block_tail) != 0)
+                return false;
+
+            /* At the end of the heap, extend_heap merges with the neighbour */
+            dbg_printf("Growing block %p at the end of the heap.\n", block);
+            if (extend_heap(arena, max(asize - csize - next_size, min_block_size),
+                            true) == NULL)
+                return false;
+        }
+
+        /* Absorb the free neighbour */
+        remove_list(arena, block_next);
+        csize += get_size(block_next);
+        write_header(block, csize, true, get_alloc_prev(block));
+        set_alloc_prev(find_next(block), true);
+    }
+
+    /* Split off the excess, which coalesces with whatever follows it */
+    if ((csize - asize) >= min_block_size)
+    {
+        write_header(block, asize, true, get_alloc_prev(block));
         block_next = find_next(block);
-        next_size = get_size(block_next);
-        next_alloc = get_alloc(block_next);
-        write_header(block_next, next_size, next_alloc, true);
+        write_header(block_next, csize-asize, false, true);
+        write_footer(block_next, csize-asize, false);
+        free_block(arena, block_next);
     }
+
+    return true;
+}
+
+/*
+ * map_block: allocates a block in a mapping of its own, large enough for
+ *            size bytes of payload. Returns a pointer to the payload, or
+ *            NULL on failure.
+ */
+static void *map_block(size_t size)
+{
+    size_t msize;   // Size of the mapping
+    char *base;     // Start of the mapping
+    block_t *block;
+
+    if (size > SIZE_MAX - dsize - mem_pagesize())
+        return NULL;
+    msize = round_up(size + dsize, mem_pagesize());
+
+    if ((base = mem_map(msize)) == NULL)
+        return NULL;
+
+    /* The header is the second word, so the payload is 16-byte aligned */
+    block = (block_t *)(base + dsize - wsize);
+    block->header = pack(msize, true, true) | 0x4;
+    dbg_printf("Mapped %zd bytes at %p.\n", msize, base);
+    return header_to_payload(block);
+}
+
+/*
+ * remap_block: resizes a mapped block to hold size bytes of payload,
+ *              moving it if needed. Returns the new payload pointer, or
+ *              NULL on failure, leaving the block untouched.
+ */
+static void *remap_block(block_t *block, size_t size)
+{
+    size_t msize;
+    char *base;
+
+    if (size > SIZE_MAX - dsize - mem_pagesize())
+        return NULL;
+    msize = round_up(size + dsize, mem_pagesize());
+
+    base = mem_remap((char *) block - (dsize - wsize), get_size(block), msize);
+    if (base == NULL)
+        return NULL;
+
+    block = (block_t *)(base + dsize - wsize);
+    block->header = pack(msize, true, true) | 0x4;
+    return header_to_payload(block);
+}
+
+/*
+ * unmap_block: gives the mapping of a mapped block back to the system.
+ */
+static void unmap_block(block_t *block)
+{
+    dbg_printf("Unmapping %zd bytes.\n", get_size(block));
+    mem_unmap((char *) block - (dsize - wsize), get_size(block));
 }
 
 /*
  * find_fit: Looks for a free block with at least asize bytes with
- *           first-fit policy. Returns NULL if none is found.
+ *           first-fit policy within asize's own list, or best-fit if that
+ *           list is a tree. Any block in a later list is large enough, so
+ *           beyond that list the first block of the next non-empty list is
+ *           taken, or the smallest if it is a tree. Returns NULL if none is
+ *           found.
  */
-static block_t *find_fit(size_t asize)
+static block_t *find_fit(arena_t *arena, size_t asize)
 {
     dbg_printf("find_fit(%zd) called\n", asize);
 
     block_t *block; 
-    size_t csize;
+    int i = get_seglist_size(asize);
+
+    /* Search the tree of large blocks */
+    if (i >= TREE_FIRST_LIST)
+    {
+        block = tree_best_fit(arena->seg_listsp[i], asize);
+        if (block != NULL)
+            return block;
+    }
 
-    /* Iterate through each segregated list */
-    for (int i = get_seglist_size(asize); i < SEG_SIZE; i++)
+    /* Iterate through the free blocks of seg_listsp[i] */
+    else for (block = arena->seg_listsp[i]; block != NULL; block = block->aof.fb.next)
     {
-        block = seg_listsp[i];
-        /* Iterate through the free blocks of seg_listsp[i] */
-        while (block != NULL)
+        /* If the shoe fits, return the block */
+        if (asize <= get_size(block))
         {
-            csize = get_size(block);
-            /* If the shoe fits, return the block */
-            if (asize <= csize)
-            {
-                dbg_printf("Free block found, removing it from list & returning.\n");
-                return block;
-            }
-            
-            block = block->aof.fb.next;
+            dbg_printf("Free block found, removing it from list & returning.\n");
+            return block;
         }
     }
 
+    /* Jump to the next non-empty list */
+    i = next_nonempty_list(arena, i + 1);
+    if (i >= 0)
+    {
+        dbg_printf("Free block found in seglist %d.\n", i);
+        if (i >= TREE_FIRST_LIST)
+            return tree_min(arena->seg_listsp[i]);
+        return arena->seg_listsp[i];
+    }
+
     dbg_printf("find_fit found no free block, returning NULL\n");
     /* No fit found */
     return NULL;
 }
 
+/*
+ * next_nonempty_list: returns the index of the first non-empty segregated
+ *                     list at or after list i, or -1 if there is none.
+ *                     Uses find-first-set on the arena's binmap.
+ */
+static int next_nonempty_list(arena_t *arena, int i)
+{
+    if (i >= SEG_SIZE)
+        return -1;
+
+    int w = i / BINMAP_BITS;
+    word_t bits = arena->binmap[w] & (~(word_t) 0 << (i % BINMAP_BITS));
+
+    while (bits == 0)
+    {
+        if (++w == BINMAP_WORDS)
+            return -1;
+        bits = arena->binmap[w];
+    }
+
+    return w*BINMAP_BITS + __builtin_ctzll(bits);
+}
+
 /*
  * get_seglist_size: returns the index of the which segregated list to 
- *                   start looking in for a free block of size asize. Each
- *                   seglist[n] holds blocks of sizes up to SIZE_LISTn so
- *                   we look for which one asize fits into.
+ *                   start looking in for a free block of size asize.
+ *                   With k = floor(log2(asize)), taken from the leading-zero
+ *                   count, the list is k's group of SEG_SUBCLASSES lists,
+ *                   and the subclass is given by the SEG_SUBCLASS_BITS bits
+ *                   below the leading one. Requires asize >= min_block_size.
  */
 static int get_seglist_size (size_t asize) 
 {
-    int index;
-
-    if (asize <= SIZE_LIST1)
-        index = 0;
-    else if ((SIZE_LIST1 < asize) && (asize <= SIZE_LIST2))
-        index = 1;
-    else if ((SIZE_LIST2 < asize) && (asize <= SIZE_LIST3))
-        index = 2;
-    else if ((SIZE_LIST3 < asize) && (asize <= SIZE_LIST4))
-        index = 3;
-    else if ((SIZE_LIST4 < asize) && (asize <= SIZE_LIST5))
-        index = 4;
-    else if ((SIZE_LIST5 < asize) && (asize <= SIZE_LIST6))
-        index = 5;
-    else if ((SIZE_LIST6 < asize) && (asize <= SIZE_LIST7))
-        index = 6;
+    int k = 63 - __builtin_clzll(asize);
+    int sub = (asize >> (k - SEG_SUBCLASS_BITS)) & (SEG_SUBCLASSES - 1);
+    int index = (k - SEG_MIN_LOG2)*SEG_SUBCLASSES + sub;
+
+    return (index < SEG_SIZE) ? index : SEG_SIZE - 1;
+}
+
+/*
+ * tree_insert: inserts a free block into the red-black tree at *root,
+ *              ordered by tree_less, then restores the red-black rules.
+ */
+static void tree_insert(block_t **root, block_t *block)
+{
+    block_t **link = root;
+    block_t *parent = NULL;
+    block_t *grand;
+    block_t *uncle;
+
+    /* Plain binary search tree insertion, as a red leaf */
+    while (*link != NULL)
+    {
+        parent = *link;
+        link = tree_less(block, parent) ? &parent->aof.tn.left : &parent->aof.tn.right;
+    }
+    block->aof.tn.left = NULL;
+    block->aof.tn.right = NULL;
+    block->aof.tn.parent = parent;
+    block->aof.tn.red = true;
+    *link = block;
+
+    /* Fix up red nodes with red parents */
+    while ((parent = block->aof.tn.parent) != NULL && tree_red(parent))
+    {
+        grand = parent->aof.tn.parent;
+        bool left = (parent == grand->aof.tn.left); // Is parent a left child?
+        uncle = left ? grand->aof.tn.right : grand->aof.tn.left;
+
+        if (tree_red(uncle))
+        {
+            /* Recolor and continue from the grandparent */
+            parent->aof.tn.red = false;
+            uncle->aof.tn.red = false;
+            grand->aof.tn.red = true;
+            block = grand;
+        }
+        else
+        {
+            /* Rotate the block to the outside, then rotate the grandparent */
+            if (block == (left ? parent->aof.tn.right : parent->aof.tn.left))
+            {
+                tree_rotate(root, parent, left);
+                block = parent;
+                parent = block->aof.tn.parent;
+            }
+            parent->aof.tn.red = false;
+            grand->aof.tn.red = true;
+            tree_rotate(root, grand, !left);
+        }
+    }
+    (*root)->aof.tn.red = false;
+}
+
+/*
+ * tree_remove: removes a free block from the red-black tree at *root,
+ *              then restores the red-black rules.
+ */
+static void tree_remove(block_t **root, block_t *block)
+{
+    block_t *y = block;       // Node actually unlinked from its position
+    block_t *x;               // Node moved into y's position, maybe NULL
+    block_t *x_parent;        // Parent of x, since x may be NULL
+    block_t *w;               // Sibling of x
+    bool y_red = tree_red(y);
+
+    if (block->aof.tn.left == NULL || block->aof.tn.right == NULL)
+    {
+        x = (block->aof.tn.left != NULL) ? block->aof.tn.left : block->aof.tn.right;
+        x_parent = block->aof.tn.parent;
+        tree_transplant(root, block, x);
+    }
+    else
+    {
+        /* Replace the block with its successor */
+        y = tree_min(block->aof.tn.right);
+        y_red = tree_red(y);
+        x = y->aof.tn.right;
+        if (y->aof.tn.parent == block)
+            x_parent = y;
+        else
+        {
+            x_parent = y->aof.tn.parent;
+            tree_transplant(root, y, x);
+            y->aof.tn.right = block->aof.tn.right;
+            y->aof.tn.right->aof.tn.parent = y;
+        }
+        tree_transplant(root, block, y);
+        y->aof.tn.left = block->aof.tn.left;
+        y->aof.tn.left->aof.tn.parent = y;
+        y->aof.tn.red = block->aof.tn.red;
+    }
+
+    if (y_red)
+        return;
+
+    /* A black node was unlinked: x carries an extra black */
+    while (x != *root && !tree_red(x))
+    {
+        bool left = (x == x_parent->aof.tn.left); // Is x a left child?
+        w = left ? x_parent->aof.tn.right : x_parent->aof.tn.left;
+
+        if (tree_red(w))
+        {
+            w->aof.tn.red = false;
+            x_parent->aof.tn.red = true;
+            tree_rotate(root, x_parent, left);
+            w = left ? x_parent->aof.tn.right : x_parent->aof.tn.left;
+        }
+
+        block_t *near = left ? w->aof.tn.left : w->aof.tn.right;
+        block_t *far = left ? w->aof.tn.right : w->aof.tn.left;
+
+        if (!tree_red(near) && !tree_red(far))
+        {
+            /* Push the extra black up */
+            w->aof.tn.red = true;
+            x = x_parent;
+            x_parent = x->aof.tn.parent;
+        }
+        else
+        {
+            if (!tree_red(far))
+            {
+                near->aof.tn.red = false;
+                w->aof.tn.red = true;
+                tree_rotate(root, w, !left);
+                w = left ? x_parent->aof.tn.right : x_parent->aof.tn.left;
+                far = left ? w->aof.tn.right : w->aof.tn.left;
+            }
+            w->aof.tn.red = x_parent->aof.tn.red;
+            x_parent->aof.tn.red = false;
+            far->aof.tn.red = false;
+            tree_rotate(root, x_parent, left);
+            x = *root;
+        }
+    }
+    if (x != NULL)
+        x->aof.tn.red = false;
+}
+
+/*
+ * tree_best_fit: returns the smallest block of at least asize bytes in the
+ *                subtree rooted at node, or NULL if there is none.
+ */
+static block_t *tree_best_fit(block_t *node, size_t asize)
+{
+    block_t *best = NULL;
+
+    while (node != NULL)
+    {
+        if (get_size(node) >= asize)
+        {
+            best = node;
+            node = node->aof.tn.left;
+        }
+        else
+            node = node->aof.tn.right;
+    }
+    return best;
+}
+
+/*
+ * tree_min: returns the smallest block of a non-empty subtree.
+ */
+static block_t *tree_min(block_t *node)
+{
+    while (node->aof.tn.left != NULL)
+        node = node->aof.tn.left;
+    return node;
+}
+
+/*
+ * tree_less: returns true when block a orders before block b, by size
+ *            and then by address.
+ */
+static bool tree_less(block_t *a, block_t *b)
+{
+    size_t asize = get_size(a);
+    size_t bsize = get_size(b);
+    return (asize < bsize) || (asize == bsize && a < b);
+}
+
+/*
+ * tree_red: returns true when node is red. Empty leaves are black.
+ */
+static bool tree_red(block_t *node)
+{
+    return node != NULL && node->aof.tn.red;
+}
+
+/*
+ * tree_rotate: rotates the subtree rooted at x to the left (x's right child
+ *              takes its place) or to the right.
+ */
+static void tree_rotate(block_t **root, block_t *x, bool left)
+{
+    block_t *y = left ? x->aof.tn.right : x->aof.tn.left;
+    block_t *inner = left ? y->aof.tn.left : y->aof.tn.right;
+
+    /* y's inner subtree moves over to x */
+    if (left)
+        x->aof.tn.right = inner;
+    else
+        x->aof.tn.left = inner;
+    if (inner != NULL)
+        inner->aof.tn.parent = x;
+
+    /* y takes x's place, with x below it */
+    tree_transplant(root, x, y);
+    if (left)
+        y->aof.tn.left = x;
     else
-        index = 7;
+        y->aof.tn.right = x;
+    x->aof.tn.parent = y;
+}
+
+/*
+ * tree_transplant: puts the subtree v where the subtree u is in the tree.
+ */
+static void tree_transplant(block_t **root, block_t *u, block_t *v)
+{
+    block_t *parent = u->aof.tn.parent;
 
-    return index;
+    if (parent == NULL)
+        *root = v;
+    else if (u == parent->aof.tn.left)
+        parent->aof.tn.left = v;
+    else
+        parent->aof.tn.right = v;
+    if (v != NULL)
+        v->aof.tn.parent = parent;
 }
 
 /*
@@ -824,6 +4658,14 @@ static size_t max(size_t x, size_t y)
     return (x > y) ? x : y;
 }
 
+/*
+ * min: returns x if x < y, and y otherwise.
+ */
+static size_t min(size_t x, size_t y)
+{
+    return (x < y) ? x : y;
+}
+
 /*
  * round_up: Rounds size up to next multiple of n
  */
@@ -865,11 +4707,14 @@ static size_t get_size(block_t *block)
 
 /*
  * get_payload_size: returns the payload size of a given block, equal to
- *                   the entire block size minus the header size.
+ *                   the entire block size minus the header size, and minus
+ *                   the padding word for mapped blocks.
  */
 static word_t get_payload_size(block_t *block)
 {
     size_t asize = get_size(block);
+    if (get_mmapped(block))
+        return asize - dsize;
     return asize - wsize;
 }
 
@@ -892,6 +4737,24 @@ static bool extract_alloc_prev(word_t word)
     return (bool)(word & 0x2);
 }
 
+/*
+ * extract_mmapped: returns true when a given header value belongs to a
+ *                  block with a mapping of its own.
+ */
+static bool extract_mmapped(word_t word)
+{
+    return (bool)(word & 0x4);
+}
+
+/*
+ * get_mmapped: returns true when the block has a mapping of its own, based
+ *              on the block header's third-lowest bit.
+ */
+static bool get_mmapped(block_t *block)
+{
+    return extract_mmapped(block->header);
+}
+
 /*
  * get_alloc: returns true when the block is allocated based on the
  *            block header's lowest bit, and false otherwise.
@@ -910,6 +4773,35 @@ static bool get_alloc_prev(block_t *block)
     return extract_alloc_prev(block->header);
 }
 
+/*
+ * extract_sampled: returns true when a given header value belongs to a
+ *                  block sampled by the heap profiler.
+ */
+static bool extract_sampled(word_t word)
+{
+    return (bool)(word & 0x8);
+}
+
+/*
+ * get_sampled: returns true when the block is sampled by the heap profiler,
+ *              based on the block header's fourth-lowest bit.
+ */
+static bool get_sampled(block_t *block)
+{
+    return extract_sampled(block->header);
+}
+
+/*
+ * set_sampled: sets or clears the sampled bit of an allocated block.
+ */
+static void set_sampled(block_t *block, bool sampled)
+{
+    if (sampled)
+        block->header |= 0x8;
+    else
+        block->header &= ~(word_t) 0x8;
+}
+
 /*
  * write_header: given a block and its size and allocation status,
  *               writes an appropriate value to the block header.
@@ -919,6 +4811,18 @@ static void write_header(block_t *block, size_t size, bool alloc, bool alloc_pre
     block->header = pack(size, alloc, alloc_prev);
 }
 
+/*
+ * set_alloc_prev: updates only the previous-allocated bit of a block's
+ *                 header, keeping its other bits.
+ */
+static void set_alloc_prev(block_t *block, bool alloc_prev)
+{
+    if (alloc_prev)
+        block->header |= 0x2;
+    else
+        block->header &= ~(word_t) 0x2;
+}
+
 /*
  * write_footer: given a block and its size and allocation status,
  *               writes an appropriate value to the block footer by first
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 #ifdef DRIVER
@@ -8,6 +9,11 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
 
 #else
 
@@ -16,10 +22,111 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t alignment, size_t size);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+extern void *aligned_alloc(size_t alignment, size_t size);
+extern void free_sized(void *ptr, size_t size);
+extern size_t malloc_usable_size(void *ptr);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Allocates n blocks of size bytes into out; returns how many were allocated */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+/* Frees n blocks, sorting ptrs by address */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Scoped regions: bump allocation, all freed at once by reset or destroy */
+typedef struct mm_region mm_region_t;
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *region, size_t size);
+extern void mm_region_reset(mm_region_t *region);
+extern void mm_region_destroy(mm_region_t *region);
+
+/* Object pools: objects of one size, allocated and freed in O(1) */
+typedef struct mm_pool mm_pool_t;
+extern mm_pool_t *mm_pool_create(size_t obj_size, size_t align);
+extern void *mm_pool_alloc(mm_pool_t *pool);
+extern void mm_pool_free(mm_pool_t *pool, void *obj);
+extern void mm_pool_destroy(mm_pool_t *pool);
+
+/* Allocator statistics, filled in by mm_get_stats */
+#define MM_STATS_LISTS 104 /* Number of segregated lists */
+typedef struct mm_stats {
+    size_t live_bytes;      /* Usable bytes in allocated blocks */
+    size_t heap_size;       /* Bytes in all heaps */
+    size_t peak_heap_size;  /* Largest heap_size so far */
+    size_t sbrk_bytes;      /* Bytes ever added to the heaps */
+    size_t mapped_bytes;    /* Bytes in blocks with a mapping of their own */
+    size_t free_bytes;      /* Bytes in free blocks on the segregated lists */
+    size_t free_blocks;     /* Number of those blocks */
+    size_t largest_free;    /* Size of the largest of them */
+    size_t list_bytes[MM_STATS_LISTS];  /* free_bytes of each list */
+    size_t list_blocks[MM_STATS_LISTS]; /* free_blocks of each list */
+    size_t mallocs;         /* Blocks allocated, by any function */
+    size_t frees;           /* Blocks freed, by any function */
+    size_t reallocs;        /* Calls to realloc */
+    size_t heap_extends;    /* Times a heap was extended */
+    double fragmentation;   /* 1 - largest_free / free_bytes, 0 if none free */
+} mm_stats_t;
+
+/* Fills in stats.  Returns false if the allocator cannot be initialized */
+extern bool mm_get_stats(mm_stats_t *stats);
+
+/* Writes the heap profile to fd in pprof's format.  Returns false on error */
+extern bool mm_prof_dump(int fd);
+
+/* Binary allocation traces, recorded by mm_trace_start */
+#define MM_TRACE_MAGIC   "MMTRACE1"
+#define MM_TRACE_VERSION 1
+typedef struct mm_trace_header {
+    char magic[8];          /* MM_TRACE_MAGIC, not NUL-terminated */
+    uint32_t version;       /* MM_TRACE_VERSION */
+    uint32_t event_size;    /* sizeof(mm_trace_event_t) */
+} mm_trace_header_t;
+
+typedef enum mm_trace_op {
+    MM_TRACE_MALLOC = 1,    /* ptr = malloc(size) */
+    MM_TRACE_CALLOC,        /* ptr = calloc(1, size) */
+    MM_TRACE_REALLOC_FROM,  /* ptr is the old block of the next event */
+    MM_TRACE_REALLOC,       /* ptr = realloc(old, size) */
+    MM_TRACE_MEMALIGN,      /* ptr = memalign(1 << align_log2, size) */
+    MM_TRACE_FREE           /* free(ptr) */
+} mm_trace_op_t;
+
+typedef struct mm_trace_event {
+    uint64_t time;          /* Nanoseconds since the trace started */
+    uint64_t ptr;           /* Block address, used as its id */
+    uint64_t size;          /* Requested size */
+    uint32_t thread;        /* Thread number, from 1 */
+    uint8_t op;             /* mm_trace_op_t */
+    uint8_t align_log2;     /* Alignment of MM_TRACE_MEMALIGN */
+    uint8_t pad[2];
+} mm_trace_event_t;
+
+/* Starts recording a trace into fd.  Returns false on failure */
+extern bool mm_trace_start(int fd);
+/* Stops recording.  Returns the number of events dropped */
+extern size_t mm_trace_stop(void);
+
+/* Tunable parameters, set with mm_setopt */
+typedef enum mm_option {
+    MM_OPT_MMAP_THRESHOLD,  /* Requests of this many bytes or more are mmapped */
+    MM_OPT_TRIM_THRESHOLD,  /* Free space this large at a heap's end is trimmed */
+    MM_OPT_PURGE_THRESHOLD, /* Free blocks this large have their pages purged */
+    MM_OPT_PURGE_DECAY_MS,  /* Purge only after this long unused; 0 purges on free */
+    MM_OPT_PROF_RATE,       /* Mean bytes between heap profile samples, 0 if off */
+    MM_OPT_HUGE_PAGES,      /* Non-zero backs the heap with huge pages; set before
+                               the first allocation, without -DDRIVER */
+    MM_OPT_PREFAULT_SIZE,   /* Bytes faulted in past a heap's break when it is made */
+    MM_OPT_PREFAULT_AHEAD,  /* Bytes a background thread keeps faulted in past the
+                               break of growing heaps, 0 if off */
+    MM_OPT_GROW_MAX         /* Largest step a heap grows by, at least 4096 bytes */
+} mm_option_t;
+
+/* Sets a tunable parameter.  Returns false if option or value is invalid */
+extern bool mm_setopt(mm_option_t option, size_t value);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int lineno);